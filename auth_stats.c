@@ -0,0 +1,206 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * auth_stats.c: records how long each authentication took, for
+ *               --auth-stats. Attempts are split into successful and failed
+ *               ones, and into the first attempt after locking and the ones
+ *               after it (which no longer pay for loading PAM modules or
+ *               connecting to their backends). The histograms are written to
+ *               the stats file as JSON after each attempt, and the counts
+ *               already in the file are kept, so that it covers all locks
+ *               (each of which is a new process without --daemon).
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "auth_stats.h"
+
+/* Upper bounds of the buckets in milliseconds: 1, 2, 4, …, 16384, and one more
+ * bucket for everything slower. */
+#define NUM_BUCKETS 16
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[NUM_BUCKETS];
+} histogram_t;
+
+/* Indexed by [success][first]. */
+static histogram_t histograms[2][2];
+static uint64_t warmup_us = 0;
+static bool warmup_done = false;
+
+static char *stats_path = NULL;
+
+/*
+ * Parses one histogram as written by write_histogram(). Returns false if the
+ * file does not contain it in that format.
+ *
+ */
+static bool read_histogram(const char *json, const char *group, const char *name, histogram_t *h) {
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\": {", group);
+    const char *p = strstr(json, key);
+    if (p == NULL)
+        return false;
+    snprintf(key, sizeof(key), "\"%s\": {", name);
+    if ((p = strstr(p, key)) == NULL)
+        return false;
+
+    unsigned long long count;
+    double total_ms, max_ms;
+    int n;
+    if (sscanf(p + strlen(key), "\"count\": %llu, \"total_ms\": %lf, \"max_ms\": %lf, \"buckets_ms\": {%n",
+               &count, &total_ms, &max_ms, &n) != 3)
+        return false;
+    p += strlen(key) + n;
+
+    histogram_t read = {.count = count, .total_us = total_ms * 1000, .max_us = max_ms * 1000};
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        unsigned long long bucket;
+        if (sscanf(p, "\"%*[^\"]\": %llu%n", &bucket, &n) != 1)
+            return false;
+        read.buckets[i] = bucket;
+        p += n;
+        if (*p == ',')
+            p += 2;
+    }
+    *h = read;
+    return true;
+}
+
+/*
+ * Loads the counts of an existing stats file, so that they are added to
+ * instead of being overwritten. A missing or unparsable file starts from
+ * zero.
+ *
+ */
+static void load_stats(void) {
+    FILE *f = fopen(stats_path, "r");
+    if (f == NULL)
+        return;
+    char json[8192];
+    const size_t length = fread(json, 1, sizeof(json) - 1, f);
+    fclose(f);
+    json[length] = '\0';
+
+    histogram_t loaded[2][2];
+    memset(loaded, '\0', sizeof(loaded));
+    for (int success = 0; success < 2; success++) {
+        const char *group = (success ? "success" : "failure");
+        if (!read_histogram(json, group, "first", &loaded[success][1]) ||
+            !read_histogram(json, group, "subsequent", &loaded[success][0])) {
+            fprintf(stderr, "[i3lock] auth stats \"%s\" are not in the expected format, starting over\n", stats_path);
+            return;
+        }
+    }
+    memcpy(histograms, loaded, sizeof(histograms));
+}
+
+/*
+ * Enables the statistics, continuing the counts already in the file. The file
+ * is written right away, so that errors show up before the screen is locked.
+ *
+ */
+bool auth_stats_open(const char *path) {
+    if ((stats_path = strdup(path)) == NULL)
+        return false;
+    load_stats();
+    if (!auth_stats_write()) {
+        free(stats_path);
+        stats_path = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Records an authentication which took the given time.
+ *
+ */
+void auth_stats_record(bool success, bool first, uint64_t duration_us) {
+    if (stats_path == NULL)
+        return;
+
+    histogram_t *h = &histograms[success][first];
+    h->count++;
+    h->total_us += duration_us;
+    if (duration_us > h->max_us)
+        h->max_us = duration_us;
+
+    int bucket = 0;
+    while (bucket < NUM_BUCKETS - 1 && duration_us > (1000ULL << bucket))
+        bucket++;
+    h->buckets[bucket]++;
+}
+
+/*
+ * Records how long the PAM warm-up (--pam-warmup) took.
+ *
+ */
+void auth_stats_record_warmup(uint64_t duration_us) {
+    warmup_us = duration_us;
+    warmup_done = true;
+}
+
+static void write_histogram(FILE *f, const char *name, const histogram_t *h) {
+    fprintf(f, "\"%s\": {\"count\": %llu, \"total_ms\": %.3f, \"max_ms\": %.3f, \"buckets_ms\": {",
+            name, (unsigned long long)h->count, h->total_us / 1000.0, h->max_us / 1000.0);
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        if (i == NUM_BUCKETS - 1)
+            fprintf(f, "\"+Inf\": %llu", (unsigned long long)h->buckets[i]);
+        else
+            fprintf(f, "\"%d\": %llu, ", 1 << i, (unsigned long long)h->buckets[i]);
+    }
+    fprintf(f, "}}");
+}
+
+/*
+ * Writes the statistics to the stats file, replacing it atomically. Returns
+ * false (after printing why) if the file could not be written.
+ *
+ */
+bool auth_stats_write(void) {
+    if (stats_path == NULL)
+        return true;
+
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.tmp", stats_path) == -1)
+        return false;
+
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "[i3lock] could not write auth stats \"%s\": %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return false;
+    }
+
+    fprintf(f, "{");
+    if (warmup_done)
+        fprintf(f, "\"warmup_ms\": %.3f, ", warmup_us / 1000.0);
+    for (int success = 1; success >= 0; success--) {
+        fprintf(f, "\"%s\": {", success ? "success" : "failure");
+        write_histogram(f, "first", &histograms[success][1]);
+        fprintf(f, ", ");
+        write_histogram(f, "subsequent", &histograms[success][0]);
+        fprintf(f, "}%s", success ? ", " : "");
+    }
+    fprintf(f, "}\n");
+
+    const bool ok = (fclose(f) == 0 && rename(tmp_path, stats_path) == 0);
+    if (!ok) {
+        fprintf(stderr, "[i3lock] could not write auth stats \"%s\": %s\n", stats_path, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ok;
+}
@@ -0,0 +1,12 @@
+#ifndef _AUTH_STATS_H
+#define _AUTH_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool auth_stats_open(const char *path);
+void auth_stats_record(bool success, bool first, uint64_t duration_us);
+void auth_stats_record_warmup(uint64_t duration_us);
+bool auth_stats_write(void);
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * bench.c: measures the render path (draw_image() and redraw_screen())
+ *          against a running X server, e.g. Xvfb or Xephyr, and prints the
+ *          results as JSON. See README.md.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
+#include <ev.h>
+#include <xcb/xcb.h>
+#include <xcb/xcb_aux.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "unlock_indicator.h"
+#include "randr.h"
+#include "dpi.h"
+
+/*******************************************************************************
+ * The variables which i3lock.c defines for the render path.
+ ******************************************************************************/
+
+bool debug_mode = false;
+int input_position = 0;
+xcb_window_t win;
+uint32_t last_resolution[2];
+bool unlock_indicator = true;
+char *modifier_string = NULL;
+cairo_surface_t *img = NULL;
+bool tile = false;
+char color[7] = "ffffff";
+int show_on_screen = -1;
+bool show_failed_attempts = false;
+int failed_attempts = 0;
+/* Without an event loop, redraw_screen() renders right away. */
+struct ev_loop *main_loop = NULL;
+double min_frame_interval = 0;
+
+extern unlock_state_t unlock_state;
+extern auth_state_t auth_state;
+
+static const uint32_t resolutions[][2] = {{1920, 1080}, {2560, 1440}, {3840, 2160}};
+static const int monitor_counts[] = {1, 2, 3};
+static const char *backgrounds[] = {"color", "image", "tile"};
+
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+/* Number of redraws per sample of the frame_floor case. */
+#define FLOOR_BATCH 1000
+
+/*
+ * Returns the number of bytes this process wrote so far (which includes
+ * everything sent to the X server), or 0 if that is unknown.
+ *
+ */
+static uint64_t bytes_written(void) {
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f == NULL)
+        return 0;
+
+    char line[128];
+    unsigned long long wchar = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "wchar: %llu", &wchar) == 1)
+            break;
+    }
+    fclose(f);
+    return wchar;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double cpu_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Returns the given percentile (nearest rank) of the sorted samples.
+ *
+ */
+static double percentile(const double *samples, int n, int p) {
+    int rank = (p * n + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return samples[rank - 1];
+}
+
+/*
+ * Creates a gradient test image, which (unlike a solid color) cannot be
+ * compressed or special-cased anywhere along the way.
+ *
+ */
+static cairo_surface_t *create_test_image(int width, int height) {
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    cairo_t *ctx = cairo_create(surface);
+    cairo_pattern_t *pattern = cairo_pattern_create_linear(0, 0, width, height);
+    cairo_pattern_add_color_stop_rgb(pattern, 0, 0.1, 0.3, 0.6);
+    cairo_pattern_add_color_stop_rgb(pattern, 1, 0.8, 0.4, 0.2);
+    cairo_set_source(ctx, pattern);
+    cairo_paint(ctx);
+    cairo_pattern_destroy(pattern);
+    cairo_destroy(ctx);
+    return surface;
+}
+
+/*
+ * Splits the screen into the given number of side-by-side monitors.
+ *
+ */
+static void set_monitors(const uint32_t *resolution, int count) {
+    free(xr_resolutions);
+    xr_resolutions = calloc(count, sizeof(Rect));
+    if (xr_resolutions == NULL)
+        err(EXIT_FAILURE, "calloc");
+    xr_screens = count;
+    for (int i = 0; i < count; i++) {
+        xr_resolutions[i].x = i * (resolution[0] / count);
+        xr_resolutions[i].y = 0;
+        xr_resolutions[i].width = resolution[0] / count;
+        xr_resolutions[i].height = resolution[1];
+    }
+}
+
+/*
+ * Prints the statistics of the given frame times and the bytes written while
+ * rendering them.
+ *
+ */
+static void print_stats(const char *name, double *samples, int n, uint64_t bytes) {
+    qsort(samples, n, sizeof(double), compare_doubles);
+    printf("\"%s\": {\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, \"bytes_per_frame\": %llu}",
+           name, percentile(samples, n, 50), percentile(samples, n, 99), samples[n - 1],
+           (unsigned long long)(bytes / n));
+}
+
+static void bench_case(const uint32_t *resolution, int monitors, const char *background, int iterations) {
+    double *samples = calloc(iterations, sizeof(double));
+    if (samples == NULL)
+        err(EXIT_FAILURE, "calloc");
+
+    last_resolution[0] = resolution[0];
+    last_resolution[1] = resolution[1];
+    set_monitors(resolution, monitors);
+    invalidate_render_state();
+
+    tile = (strcmp(background, "tile") == 0);
+    if (strcmp(background, "image") == 0)
+        img = create_test_image(resolution[0], resolution[1]);
+    else if (tile)
+        img = create_test_image(256, 256);
+    else
+        img = NULL;
+
+    /* A window of the benchmarked size, for redraw_screen(). */
+    win = xcb_generate_id(conn);
+    xcb_create_window(conn, XCB_COPY_FROM_PARENT, win, screen->root,
+                      0, 0, resolution[0], resolution[1], 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_WINDOW_CLASS_COPY_FROM_PARENT,
+                      XCB_CW_OVERRIDE_REDIRECT, (uint32_t[]){1});
+    xcb_map_window(conn, win);
+    xcb_aux_sync(conn);
+
+    printf("    {\"resolution\": \"%ux%u\", \"monitors\": %d, \"background\": \"%s\", ",
+           resolution[0], resolution[1], monitors, background);
+
+    /* Full frames: background and unlock indicator. */
+    unlock_state = STATE_KEY_PRESSED;
+    auth_state = STATE_AUTH_IDLE;
+    input_position = 8;
+    xcb_pixmap_t pixmap = create_bg_pixmap(conn, screen, last_resolution, NULL);
+    uint64_t bytes = bytes_written();
+    for (int i = 0; i < iterations; i++) {
+        const double start = now_ms();
+        draw_image(pixmap, last_resolution);
+        xcb_aux_sync(conn);
+        samples[i] = now_ms() - start;
+    }
+    print_stats("draw_image", samples, iterations, bytes_written() - bytes);
+    xcb_free_pixmap(conn, pixmap);
+    printf(", ");
+
+    /* Indicator updates, as while typing. The first frame renders the
+     * background layer and is not counted. */
+    free_bg_pixmap();
+    redraw_screen();
+    xcb_aux_sync(conn);
+    bytes = bytes_written();
+    for (int i = 0; i < iterations; i++) {
+        input_position = 1 + (i % 16);
+        const double start = now_ms();
+        redraw_screen();
+        xcb_aux_sync(conn);
+        samples[i] = now_ms() - start;
+    }
+    print_stats("redraw_screen", samples, iterations, bytes_written() - bytes);
+    printf(", ");
+
+    /* The per-frame CPU floor: redraws which end up changing nothing, so all
+     * that is left is the work done before the frame is found to be
+     * unchanged. Batches of FLOOR_BATCH redraws are measured, as a single
+     * one is close to the clock’s resolution. */
+    redraw_screen();
+    for (int i = 0; i < iterations; i++) {
+        const double start = cpu_time_us();
+        for (int j = 0; j < FLOOR_BATCH; j++)
+            redraw_screen();
+        samples[i] = (cpu_time_us() - start) / FLOOR_BATCH;
+    }
+    qsort(samples, iterations, sizeof(double), compare_doubles);
+    printf("\"frame_floor\": {\"p50_us\": %.3f, \"p99_us\": %.3f}",
+           percentile(samples, iterations, 50), percentile(samples, iterations, 99));
+    printf("}");
+
+    free_bg_pixmap();
+    xcb_destroy_window(conn, win);
+    if (img != NULL)
+        cairo_surface_destroy(img);
+    img = NULL;
+    free(samples);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 30;
+    int o;
+
+    while ((o = getopt(argc, argv, "n:d")) != -1) {
+        switch (o) {
+            case 'n':
+                if (sscanf(optarg, "%d", &iterations) != 1 || iterations < 1)
+                    errx(EXIT_FAILURE, "invalid number of iterations\n");
+                break;
+            case 'd':
+                debug_mode = true;
+                break;
+            default:
+                errx(EXIT_FAILURE, "Syntax: i3lock-bench [-n iterations] [-d]");
+        }
+    }
+
+    int screennr;
+    if ((conn = xcb_connect(NULL, &screennr)) == NULL ||
+        xcb_connection_has_error(conn))
+        errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
+    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+    init_dpi();
+
+    printf("{\n  \"iterations\": %d,\n  \"cases\": [\n", iterations);
+    bool first = true;
+    for (size_t r = 0; r < COUNT(resolutions); r++) {
+        for (size_t m = 0; m < COUNT(monitor_counts); m++) {
+            for (size_t b = 0; b < COUNT(backgrounds); b++) {
+                if (!first)
+                    printf(",\n");
+                first = false;
+                bench_case(resolutions[r], monitor_counts[m], backgrounds[b], iterations);
+                /* Keep printf’s buffer out of the measured bytes. */
+                fflush(stdout);
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    xcb_disconnect(conn);
+    return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * daemon.c: accepts lock requests on a UNIX socket (--daemon).
+ *
+ * A client sends "lock\n" and receives "locked\n" once the screen is locked,
+ * then "unlocked\n" when it is unlocked again, after which the connection is
+ * closed. Waiting for the connection to be closed thus behaves like running
+ * i3lock -n, e.g. for xss-lock. "status\n" is answered with either "locked\n"
+ * or "unlocked\n".
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "daemon.h"
+
+extern bool debug_mode;
+extern struct ev_loop *main_loop;
+
+/* Connections beyond this many are closed right away. */
+#define MAX_CLIENTS 16
+
+static struct {
+    ev_io watcher;
+    /* Whether this slot is in use. */
+    bool connected;
+    /* Whether the client is waiting for the screen to be unlocked. */
+    bool waiting;
+} clients[MAX_CLIENTS];
+
+static int listen_fd = -1;
+static char *socket_path = NULL;
+static ev_io listen_watcher;
+static daemon_lock_cb_t lock_cb;
+static bool screen_locked = false;
+
+static void close_client(int i) {
+    ev_io_stop(main_loop, &clients[i].watcher);
+    close(clients[i].watcher.fd);
+    clients[i].connected = false;
+    clients[i].waiting = false;
+}
+
+static void reply(int i, const char *message) {
+    /* The replies are tiny, so they fit into the socket buffer. */
+    if (write(clients[i].watcher.fd, message, strlen(message)) == -1)
+        DEBUG("could not reply to daemon client: %s\n", strerror(errno));
+}
+
+static void client_cb(EV_P_ ev_io *w, int revents) {
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (&clients[i].watcher == w)
+            break;
+    }
+
+    char command[32];
+    const ssize_t n = read(w->fd, command, sizeof(command) - 1);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        close_client(i);
+        return;
+    }
+    command[n] = '\0';
+    command[strcspn(command, "\r\n")] = '\0';
+    DEBUG("daemon command \"%s\"\n", command);
+
+    if (strcmp(command, "lock") == 0) {
+        if (!screen_locked && !lock_cb()) {
+            reply(i, "error\n");
+            close_client(i);
+            return;
+        }
+        /* The connection stays open until the screen is unlocked. */
+        reply(i, "locked\n");
+        clients[i].waiting = true;
+    } else if (strcmp(command, "status") == 0) {
+        reply(i, screen_locked ? "locked\n" : "unlocked\n");
+        close_client(i);
+    } else {
+        reply(i, "error\n");
+        close_client(i);
+    }
+}
+
+static void accept_cb(EV_P_ ev_io *w, int revents) {
+    const int fd = accept(w->fd, NULL, NULL);
+    if (fd == -1)
+        return;
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].connected)
+            continue;
+        clients[i].connected = true;
+        clients[i].waiting = false;
+        ev_io_init(&clients[i].watcher, client_cb, fd, EV_READ);
+        ev_io_start(EV_A_ &clients[i].watcher);
+        return;
+    }
+
+    DEBUG("too many daemon clients, closing connection\n");
+    close(fd);
+}
+
+/*
+ * Listens for lock requests on the given socket path. lock is called for each
+ * request while the screen is not locked, and returns whether locking
+ * succeeded.
+ *
+ */
+bool daemon_listen(const char *path, daemon_lock_cb_t lock) {
+    struct sockaddr_un addr;
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[i3lock] socket path \"%s\" is too long\n", path);
+        return false;
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("[i3lock] socket");
+        return false;
+    }
+    (void)fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+    /* Only a socket left behind by a daemon which was killed is replaced. If
+     * another daemon still accepts connections, it keeps its socket. */
+    int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe_fd != -1) {
+        const bool live = (connect(probe_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        const int probe_errno = errno;
+        close(probe_fd);
+        if (live) {
+            fprintf(stderr, "[i3lock] another i3lock is already listening on \"%s\"\n", path);
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+        if (probe_errno == ECONNREFUSED)
+            (void)unlink(path);
+    }
+
+    /* Only the user may lock (and learn whether the screen is locked). */
+    const mode_t old_umask = umask(0077);
+    const int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound == -1 || listen(listen_fd, MAX_CLIENTS) == -1) {
+        fprintf(stderr, "[i3lock] could not listen on \"%s\": %s\n", path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    socket_path = strdup(path);
+    lock_cb = lock;
+    ev_io_init(&listen_watcher, accept_cb, listen_fd, EV_READ);
+    ev_io_start(main_loop, &listen_watcher);
+    DEBUG("listening for lock requests on %s\n", path);
+    return true;
+}
+
+/*
+ * Called once the screen is locked, also if requested by other means (e.g.
+ * SIGUSR1).
+ *
+ */
+void daemon_locked(void) {
+    screen_locked = true;
+}
+
+/*
+ * Called when the screen was unlocked: tells all waiting clients and closes
+ * their connections.
+ *
+ */
+void daemon_unlocked(void) {
+    screen_locked = false;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (!clients[i].connected || !clients[i].waiting)
+            continue;
+        reply(i, "unlocked\n");
+        close_client(i);
+    }
+}
+
+/*
+ * Stops listening and removes the socket.
+ *
+ */
+void daemon_cleanup(void) {
+    if (listen_fd == -1)
+        return;
+    daemon_unlocked();
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].connected)
+            close_client(i);
+    }
+    ev_io_stop(main_loop, &listen_watcher);
+    close(listen_fd);
+    listen_fd = -1;
+    (void)unlink(socket_path);
+    free(socket_path);
+    socket_path = NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdbool.h>
+
+typedef bool (*daemon_lock_cb_t)(void);
+
+bool daemon_listen(const char *path, daemon_lock_cb_t lock);
+void daemon_locked(void);
+void daemon_unlocked(void);
+void daemon_cleanup(void);
+
+#endif
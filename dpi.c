@@ -10,6 +10,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <xcb/xcb_xrm.h>
 #include "xcb.h"
 #include "i3lock.h"
@@ -20,10 +21,56 @@ static long dpi;
 
 extern xcb_screen_t *screen;
 
+static xcb_get_property_cookie_t resource_manager_cookie;
+static bool resource_manager_requested = false;
+
 static long init_dpi_fallback(void) {
     return (double)screen->height_in_pixels * 25.4 / (double)screen->height_in_millimeters;
 }
 
+/*
+ * Requests the RESOURCE_MANAGER property (which is what
+ * xcb_xrm_database_from_default() reads), so that init_dpi() does not need
+ * to wait for a round trip.
+ *
+ */
+void prefetch_dpi(void) {
+    if (conn == NULL || screen == NULL) {
+        return;
+    }
+
+    resource_manager_cookie = xcb_get_property(conn, false, screen->root, XCB_ATOM_RESOURCE_MANAGER,
+                                               XCB_ATOM_STRING, 0, UINT32_MAX / 4);
+    resource_manager_requested = true;
+}
+
+/*
+ * Creates the resource database from the prefetched RESOURCE_MANAGER
+ * property, or fetches it now if it was not prefetched.
+ *
+ */
+static xcb_xrm_database_t *resource_database(void) {
+    if (!resource_manager_requested) {
+        return xcb_xrm_database_from_default(conn);
+    }
+    resource_manager_requested = false;
+
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(conn, resource_manager_cookie, NULL);
+    if (reply == NULL) {
+        return NULL;
+    }
+
+    char *resources = strndup(xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+    free(reply);
+    if (resources == NULL) {
+        return NULL;
+    }
+
+    xcb_xrm_database_t *database = xcb_xrm_database_from_string(resources);
+    free(resources);
+    return database;
+}
+
 /*
  * Initialize the DPI setting.
  * This will use the 'Xft.dpi' X resource if available and fall back to
@@ -37,7 +84,7 @@ void init_dpi(void) {
         goto init_dpi_end;
     }
 
-    database = xcb_xrm_database_from_default(conn);
+    database = resource_database();
     if (database == NULL) {
         DEBUG("Failed to open the resource database.\n");
         goto init_dpi_end;
@@ -1,5 +1,12 @@
 #pragma once
 
+/**
+ * Requests the X resources which init_dpi() reads, so that their reply
+ * arrives while other startup work is going on.
+ *
+ */
+void prefetch_dpi(void);
+
 /**
  * Initialize the DPI setting.
  * This will use the 'Xft.dpi' X resource if available and fall back to
@@ -27,8 +27,13 @@
 #include <security/pam_appl.h>
 #endif
 #include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
 #include <ev.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <xkbcommon/xkbcommon.h>
 #include <xkbcommon/xkbcommon-compose.h>
 #include <xkbcommon/xkbcommon-x11.h>
@@ -39,6 +44,8 @@
 #endif
 #include <xcb/xcb_aux.h>
 #include <xcb/randr.h>
+#include <xcb/xinerama.h>
+#include <xcb/present.h>
 
 #include "i3lock.h"
 #include "xcb.h"
@@ -46,16 +53,36 @@
 #include "unlock_indicator.h"
 #include "randr.h"
 #include "dpi.h"
+#include "present.h"
+#include "screenshot.h"
+#include "xrender.h"
+#include "image.h"
+#include "profile.h"
+#include "trace.h"
+#include "daemon.h"
+#include "auth_stats.h"
 
 #define TSTAMP_N_SECS(n) (n * 1.0)
 #define TSTAMP_N_MINS(n) (60 * TSTAMP_N_SECS(n))
+
+/* How long to try grabbing pointer and keyboard before stealing the focus
+ * (which closes context menus holding a grab), and after. */
+#define GRAB_TIMEOUT TSTAMP_N_SECS(0.25)
+#define GRAB_TIMEOUT_AFTER_FOCUS TSTAMP_N_SECS(2.25)
+
+/* All timers are preallocated (see below), these just (re)start and stop
+ * them. */
 #define START_TIMER(timer_obj, timeout, callback) \
-    timer_obj = start_timer(timer_obj, timeout, callback)
+    start_timer(&(timer_obj), timeout, callback)
 #define STOP_TIMER(timer_obj) \
-    timer_obj = stop_timer(timer_obj)
+    ev_timer_stop(main_loop, &(timer_obj))
 
 typedef void (*ev_callback_t)(EV_P_ ev_timer *w, int revents);
 static void input_done(void);
+static void redraw_timeout_cb(EV_P_ ev_timer *w, int revents);
+static void discard_passwd_cb(EV_P_ ev_timer *w, int revents);
+static void handle_input_event(xcb_generic_event_t *event);
+static void enter_standby(void);
 
 char color[7] = "ffffff";
 uint32_t last_resolution[2];
@@ -73,31 +100,116 @@ bool debug_mode = false;
 bool unlock_indicator = true;
 char *modifier_string = NULL;
 static bool dont_fork = false;
+/* The child’s end of the socket to the parent process, see fork_early(). */
+static int lock_report_fd = -1;
+static bool use_present = false;
+/* Whether to draw the unlock indicator with Render (--xrender). */
+static bool use_xrender = false;
+/* Whether i3lock keeps running in standby after unlocking (--daemon). */
+static bool daemon_mode = false;
+static char *daemon_socket = NULL;
+/* Whether the screen is currently locked. Without --daemon, it is locked
+ * from startup until i3lock exits. */
+static bool locked = false;
+/* The window which was focused before locking, to restore the focus. */
+static xcb_window_t stolen_focus = XCB_NONE;
+/* Whether the image is only kept on the X server (--low-memory). */
+static bool low_memory = false;
+/* The image (-i) and its format (--raw), kept to load the image again. */
+static char *image_path = NULL;
+static char *image_raw_format = NULL;
+/* The part of the image which was loaded, if it was cropped. */
+static Rect image_crop;
+static bool image_cropped = false;
+/* With --async-image, the image is decoded on image_thread while the screen is
+ * already covered with the background color. */
+static bool async_image = false;
+/* Whether decoded images are kept in $XDG_CACHE_HOME/i3lock (--cache-image). */
+static bool cache_image = false;
+/* Whether to display a capture of the screen instead of an image
+ * (--screenshot), blurred (--blur) or pixelated (--pixelate). */
+static bool screenshot = false;
+static int blur_sigma = 0;
+static int pixelate_size = 0;
+static pthread_t image_thread;
+static bool image_loading = false;
+static cairo_surface_t *loaded_image = NULL;
+static struct ev_async image_ready_watcher;
 int show_on_screen = -1;
 struct ev_loop *main_loop;
-static struct ev_timer *clear_auth_wrong_timeout;
-static struct ev_timer *clear_indicator_timeout;
-static struct ev_timer *discard_passwd_timeout;
+static struct ev_timer clear_auth_wrong_timeout;
+static struct ev_timer clear_indicator_timeout;
+static struct ev_timer discard_passwd_timeout;
+static struct ev_timer redraw_timeout;
+/* Set when typed characters need the timers above restarted, which is done
+ * once per batch of key presses (see restart_input_timers()). */
+static bool input_timers_pending = false;
+/* Minimum time between two frames, see --max-fps. */
+double min_frame_interval = 0;
 extern unlock_state_t unlock_state;
 extern auth_state_t auth_state;
 int failed_attempts = 0;
 bool show_failed_attempts = false;
 bool retry_verification = false;
 
+/* Authentication runs in a helper thread, so that the event loop keeps
+ * handling X11 events and redraws while PAM is busy. */
+static pthread_t auth_thread;
+static bool auth_in_flight = false;
+static bool auth_result;
+static struct ev_async *auth_done_watcher;
+#ifdef __OpenBSD__
+static char *auth_username;
+#endif
+/* Whether the next authentication is the first one since locking, for
+ * --auth-stats. */
+static bool first_auth = true;
+/* Whether PAM is warmed up in the background (--pam-warmup), see
+ * pam_warmup_main(). */
+static bool pam_warmup = false;
+static pthread_t pam_warmup_thread;
+static bool pam_warmup_running = false;
+
+/* Key presses and XKB events which are received while verifying. They are
+ * handled in order once the result is known, just like they would have been
+ * handled after a blocking pam_authenticate(). */
+#define MAX_DEFERRED_EVENTS 256
+static xcb_generic_event_t *deferred_events[MAX_DEFERRED_EVENTS];
+static int num_deferred_events = 0;
+
 static struct xkb_state *xkb_state;
 static struct xkb_context *xkb_context;
 static struct xkb_keymap *xkb_keymap;
 static struct xkb_compose_table *xkb_compose_table;
 static struct xkb_compose_state *xkb_compose_state;
+/* The current keymap as text, to recognize when the same one is sent again. */
+static char *xkb_keymap_string;
+/* Set by XKB events which change the keymap. It is loaded again once per
+ * burst of them, see reload_keymap(). */
+static bool keymap_changed = false;
+/* The compose table is only loaded when needed, see load_compose_table_lazily(). */
+static const char *compose_locale = NULL;
+static bool compose_table_loaded = false;
+static struct ev_idle compose_idle_watcher;
 static uint8_t xkb_base_event;
 static uint8_t xkb_base_error;
-static int randr_base = -1;
+/* The core keyboard device, which does not change while we are running. */
+static int32_t xkb_device_id = -1;
+/* The root window’s size as of the last ConfigureNotify. */
+static uint32_t root_resolution[2];
+/* Set by events which might change the screen layout, see
+ * handle_screen_resize(). */
+static bool screen_changed = false;
 
 cairo_surface_t *img = NULL;
 bool tile = false;
 bool ignore_empty_password = false;
 bool skip_repeated_empty_password = false;
 
+/* The last dead key as of xkbcommon 1.0 (dead_longsolidusoverlay). They
+ * start at XKB_KEY_dead_grave. */
+#define XKB_KEY_DEAD_LAST 0xfe93
+
 /* isutf, u8_dec © 2005 Jeff Bezanson, public domain */
 #define isutf(c) (((c)&0xC0) != 0x80)
 
@@ -123,28 +235,57 @@ static bool load_keymap(void) {
         }
     }
 
-    xkb_keymap_unref(xkb_keymap);
-
-    int32_t device_id = xkb_x11_get_core_keyboard_device_id(conn);
+    if (xkb_device_id == -1)
+        xkb_device_id = xkb_x11_get_core_keyboard_device_id(conn);
+    int32_t device_id = xkb_device_id;
     DEBUG("device = %d\n", device_id);
-    if ((xkb_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
+    struct xkb_keymap *new_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0);
+    if (new_keymap == NULL) {
         fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
         return false;
     }
 
+    /* Tools like setxkbmap send the same keymap again; keeping the current
+     * one then also keeps the keyboard and compose state. */
+    char *new_keymap_string = xkb_keymap_get_as_string(new_keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+    if (xkb_keymap_string != NULL && new_keymap_string != NULL &&
+        strcmp(xkb_keymap_string, new_keymap_string) == 0) {
+        DEBUG("keymap did not change\n");
+        free(new_keymap_string);
+        xkb_keymap_unref(new_keymap);
+        return true;
+    }
+
     struct xkb_state *new_state =
-        xkb_x11_state_new_from_device(xkb_keymap, conn, device_id);
+        xkb_x11_state_new_from_device(new_keymap, conn, device_id);
     if (new_state == NULL) {
         fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
+        free(new_keymap_string);
+        xkb_keymap_unref(new_keymap);
         return false;
     }
 
     xkb_state_unref(xkb_state);
     xkb_state = new_state;
+    xkb_keymap_unref(xkb_keymap);
+    xkb_keymap = new_keymap;
+    free(xkb_keymap_string);
+    xkb_keymap_string = new_keymap_string;
 
     return true;
 }
 
+/*
+ * Reloads the keymap after it changed on the server.
+ *
+ */
+static void reload_keymap(void) {
+    keymap_changed = false;
+    TRACE_BEGIN(start);
+    (void)load_keymap();
+    TRACE_END(start, "reload_keymap");
+}
+
 /*
  * Loads the XKB compose table from the given locale.
  *
@@ -169,6 +310,28 @@ static bool load_compose_table(const char *locale) {
     return true;
 }
 
+/*
+ * Loads the compose table, unless it was loaded already. Parsing the locale’s
+ * Compose file takes a while, so this happens when the event loop is idle
+ * after locking, or on the first dead or compose key pressed before that.
+ *
+ */
+static void load_compose_table_lazily(void) {
+    if (compose_table_loaded || compose_locale == NULL)
+        return;
+    compose_table_loaded = true;
+    if (main_loop != NULL)
+        ev_idle_stop(main_loop, &compose_idle_watcher);
+
+    TRACE_BEGIN(start);
+    load_compose_table(compose_locale);
+    TRACE_END(start, "load_compose_table");
+}
+
+static void compose_idle_cb(EV_P_ ev_idle *w, int revents) {
+    load_compose_table_lazily();
+}
+
 /*
  * Clears the memory which stored the password to be a bit safer against
  * cold-boot attacks.
@@ -192,29 +355,30 @@ static void clear_password_memory(void) {
 #endif
 }
 
-ev_timer *start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
-    if (timer_obj) {
-        ev_timer_stop(main_loop, timer_obj);
-        ev_timer_set(timer_obj, timeout, 0.);
-        ev_timer_start(main_loop, timer_obj);
-    } else {
-        /* When there is no memory, we just don’t have a timeout. We cannot
-         * exit() here, since that would effectively unlock the screen. */
-        timer_obj = calloc(sizeof(struct ev_timer), 1);
-        if (timer_obj) {
-            ev_timer_init(timer_obj, callback, timeout, 0.);
-            ev_timer_start(main_loop, timer_obj);
-        }
-    }
-    return timer_obj;
+static void start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
+    ev_timer_stop(main_loop, timer_obj);
+    ev_timer_init(timer_obj, callback, timeout, 0.);
+    ev_timer_start(main_loop, timer_obj);
 }
 
-ev_timer *stop_timer(ev_timer *timer_obj) {
-    if (timer_obj) {
-        ev_timer_stop(main_loop, timer_obj);
-        free(timer_obj);
+/*
+ * Restarts the timers of typed characters: the delayed redraw and discarding
+ * the password after 3 minutes. When a whole burst of key presses is read at
+ * once (e.g. autotype or pasting), this only happens once, after the last
+ * one. Called at the end of each batch and before anything which needs the
+ * timers in order.
+ *
+ */
+static void restart_input_timers(void) {
+    if (!input_timers_pending)
+        return;
+    input_timers_pending = false;
+
+    if (unlock_indicator) {
+        START_TIMER(redraw_timeout, TSTAMP_N_SECS(0.25), redraw_timeout_cb);
+        STOP_TIMER(clear_indicator_timeout);
     }
-    return NULL;
+    START_TIMER(discard_passwd_timeout, TSTAMP_N_MINS(3), discard_passwd_cb);
 }
 
 /*
@@ -222,6 +386,7 @@ ev_timer *stop_timer(ev_timer *timer_obj) {
  *
  */
 static void finish_input(void) {
+    restart_input_timers();
     password[input_position] = '\0';
     unlock_state = STATE_KEY_PRESSED;
     redraw_screen();
@@ -244,7 +409,7 @@ static void clear_auth_wrong(EV_P_ ev_timer *w, int revents) {
         modifier_string = NULL;
     }
 
-    /* Now free this timeout. */
+    /* Now stop this timeout. */
     STOP_TIMER(clear_auth_wrong_timeout);
 
     /* retry with input done during auth verification */
@@ -266,45 +431,160 @@ static void clear_input(void) {
 }
 
 static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
-    clear_input();
+    /* The password is still being read by the authentication thread and
+     * will be cleared once it is done. */
+    if (!auth_in_flight)
+        clear_input();
     STOP_TIMER(discard_passwd_timeout);
 }
 
-static void input_done(void) {
-    STOP_TIMER(clear_auth_wrong_timeout);
-    auth_state = STATE_AUTH_VERIFY;
-    unlock_state = STATE_STARTED;
-    redraw_screen();
+#ifndef __OpenBSD__
+/*
+ * Runs the account management stack once, without a password. PAM cannot
+ * preload the auth stack without running it, so this only helps as a side
+ * effect: account modules which share their backend with the auth stack (e.g.
+ * pam_sss talking to sssd) connect to it before the first authentication.
+ * This needs an account entry in /etc/pam.d/i3lock (see pam/i3lock), as PAM
+ * falls back to /etc/pam.d/other without one. It is not an authentication
+ * attempt, and the result only shows up in the debug output.
+ *
+ */
+static void *pam_warmup_main(void *arg) {
+    const uint64_t start = trace_now();
+    const int ret = pam_acct_mgmt(pam_handle, PAM_SILENT);
+    TRACE_END_ARG(start, "pam_warmup", "result", ret);
+    auth_stats_record_warmup(trace_now() - start);
+    DEBUG("PAM warm-up done after %.1f ms: %s\n", (trace_now() - start) / 1000.0, pam_strerror(pam_handle, ret));
+    return NULL;
+}
+#endif
 
+/*
+ * Starts warming up PAM in the background, if enabled and not running yet.
+ *
+ */
+static void start_pam_warmup(void) {
+#ifndef __OpenBSD__
+    if (!pam_warmup || pam_warmup_running)
+        return;
+    if (pthread_create(&pam_warmup_thread, NULL, pam_warmup_main, NULL) == 0)
+        pam_warmup_running = true;
+#endif
+}
+
+/*
+ * Waits for the warm-up, as the PAM handle must only be used by one thread at
+ * a time.
+ *
+ */
+static void finish_pam_warmup(void) {
+    if (!pam_warmup_running)
+        return;
+    TRACE_BEGIN(start);
+    pthread_join(pam_warmup_thread, NULL);
+    pam_warmup_running = false;
+    TRACE_END(start, "pam_warmup_wait");
+}
+
+/*
+ * Verifies the password. Called in the authentication thread, so it must
+ * not touch anything but the password (which is not modified while
+ * verifying) and the PAM handle.
+ *
+ */
+static bool verify_password(void) {
 #ifdef __OpenBSD__
-    struct passwd *pw;
+    return (auth_userokay(auth_username, NULL, NULL, password) != 0);
+#else
+    TRACE_BEGIN(start);
+    const int ret = pam_authenticate(pam_handle, 0);
+    TRACE_END_ARG(start, "pam_authenticate", "result", ret);
+    if (ret != PAM_SUCCESS)
+        return false;
 
-    if (!(pw = getpwuid(getuid())))
-        errx(1, "unknown uid %u.", getuid());
+    /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
+     * Related to credentials pam_end() needs to be called to cleanup any temporary
+     * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
+     * refresh of the credentials failed. */
+    pam_setcred(pam_handle, PAM_REFRESH_CRED);
+    return true;
+#endif
+}
 
-    if (auth_userokay(pw->pw_name, NULL, NULL, password) != 0) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
+/*
+ * Verifies the password and records how long that took (called in the
+ * authentication thread, too).
+ *
+ */
+static bool authenticate(void) {
+    finish_pam_warmup();
+    const uint64_t start = trace_now();
+    const bool success = verify_password();
+    auth_stats_record(success, first_auth, trace_now() - start);
+    first_auth = false;
+    return success;
+}
 
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
-        return;
+static void *auth_thread_main(void *arg) {
+    auth_result = authenticate();
+    ev_async_send(main_loop, auth_done_watcher);
+    return NULL;
+}
+
+/*
+ * Handles the input events which were deferred while verifying, until they
+ * are all handled or one of them starts another verification.
+ *
+ */
+static void handle_deferred_events(void) {
+    int i;
+    for (i = 0; i < num_deferred_events && !auth_in_flight; i++) {
+        handle_input_event(deferred_events[i]);
+        free(deferred_events[i]);
     }
-#else
-    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
+    num_deferred_events -= i;
+    memmove(deferred_events, deferred_events + i, num_deferred_events * sizeof(xcb_generic_event_t *));
+    restart_input_timers();
+}
+
+/*
+ * Defers the given input event if a verification is in flight. Returns true
+ * if the event was taken over (and must not be handled or freed).
+ *
+ */
+static bool defer_input_event(xcb_generic_event_t *event) {
+    if (!auth_in_flight)
+        return false;
+
+    if (num_deferred_events == MAX_DEFERRED_EVENTS) {
+        DEBUG("too many events while verifying, dropping one\n");
+        free(event);
+        return true;
+    }
+    deferred_events[num_deferred_events++] = event;
+    return true;
+}
+
+/*
+ * Called on the main loop once the password was verified.
+ *
+ */
+static void auth_done(bool success) {
+    auth_stats_write();
+    if (success) {
         DEBUG("successfully authenticated\n");
         clear_password_memory();
-
-        /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
-         * Related to credentials pam_end() needs to be called to cleanup any temporary
-         * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
-         * refresh of the credentials failed. */
-        pam_setcred(pam_handle, PAM_REFRESH_CRED);
+#ifndef __OpenBSD__
         pam_cleanup = true;
+#endif
 
+        if (daemon_mode) {
+            enter_standby();
+            return;
+        }
         ev_break(EV_DEFAULT, EVBREAK_ALL);
         return;
     }
-#endif
 
     if (debug_mode)
         fprintf(stderr, "Authentication failure\n");
@@ -364,11 +644,67 @@ static void input_done(void) {
         xcb_bell(conn, 100);
         xcb_flush(conn);
     }
+
+    handle_deferred_events();
 }
 
-static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
+/*
+ * Waits for the authentication thread and handles its result.
+ *
+ */
+static void finish_authentication(void) {
+    if (!auth_in_flight)
+        return;
+
+    pthread_join(auth_thread, NULL);
+    auth_in_flight = false;
+    auth_done(auth_result);
+}
+
+static void auth_done_cb(EV_P_ ev_async *w, int revents) {
+    finish_authentication();
+}
+
+/*
+ * Waits for the threads which use the PAM handle (authentication and
+ * warm-up) before exiting, without handling the result: SIGTERM or SIGINT may
+ * end the event loop of --daemon while either of them is still running.
+ *
+ */
+static void join_pam_threads(void) {
+    if (auth_in_flight) {
+        pthread_join(auth_thread, NULL);
+        auth_in_flight = false;
+    }
+    finish_pam_warmup();
+}
+
+static void input_done(void) {
+    STOP_TIMER(clear_auth_wrong_timeout);
+    auth_state = STATE_AUTH_VERIFY;
+    unlock_state = STATE_STARTED;
+    redraw_screen();
+
+#ifdef __OpenBSD__
+    if (auth_username == NULL) {
+        struct passwd *pw;
+
+        if (!(pw = getpwuid(getuid())))
+            errx(1, "unknown uid %u.", getuid());
+        auth_username = strdup(pw->pw_name);
+    }
+#endif
+
+    auth_in_flight = true;
+    if (pthread_create(&auth_thread, NULL, auth_thread_main, NULL) != 0) {
+        /* Verify synchronously if no thread can be created. */
+        auth_in_flight = false;
+        auth_done(authenticate());
+    }
+}
+
+static void redraw_timeout_cb(EV_P_ ev_timer *w, int revents) {
     redraw_screen();
-    STOP_TIMER(w);
 }
 
 static bool skip_without_validation(void) {
@@ -394,7 +730,17 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     bool ctrl;
     bool composed = false;
 
+    present_mark_input();
+
+    /* The key might have been pressed after a keymap change in the
+     * same burst of events. */
+    if (keymap_changed)
+        reload_keymap();
+
     ksym = xkb_state_key_get_one_sym(xkb_state, event->detail);
+    /* Compose sequences start with a dead key or Multi_key. */
+    if (ksym == XKB_KEY_Multi_key || (ksym >= XKB_KEY_dead_grave && ksym <= XKB_KEY_DEAD_LAST))
+        load_compose_table_lazily();
     ctrl = xkb_state_mod_name_is_active(xkb_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_DEPRESSED);
 
     /* The buffer will be null-terminated, so n >= 2 for 1 actual character. */
@@ -481,6 +827,7 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             if (ksym == XKB_KEY_h && !ctrl)
                 break;
 
+            restart_input_timers();
             if (input_position == 0) {
                 START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
                 unlock_state = STATE_NOTHING_TO_DELETE;
@@ -527,13 +874,9 @@ static void handle_key_press(xcb_key_press_event_t *event) {
         unlock_state = STATE_KEY_ACTIVE;
         redraw_screen();
         unlock_state = STATE_KEY_PRESSED;
-
-        struct ev_timer *timeout = NULL;
-        START_TIMER(timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
-        STOP_TIMER(clear_indicator_timeout);
     }
 
-    START_TIMER(discard_passwd_timeout, TSTAMP_N_MINS(3), discard_passwd_cb);
+    input_timers_pending = true;
 }
 
 /*
@@ -577,7 +920,7 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
 
     DEBUG("process_xkb_event for device %d\n", event->any.deviceID);
 
-    if (event->any.deviceID != xkb_x11_get_core_keyboard_device_id(conn))
+    if (event->any.deviceID != xkb_device_id)
         return;
 
     /*
@@ -588,11 +931,11 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
     switch (event->any.xkbType) {
         case XCB_XKB_NEW_KEYBOARD_NOTIFY:
             if (event->new_keyboard_notify.changed & XCB_XKB_NKN_DETAIL_KEYCODES)
-                (void)load_keymap();
+                keymap_changed = true;
             break;
 
         case XCB_XKB_MAP_NOTIFY:
-            (void)load_keymap();
+            keymap_changed = true;
             break;
 
         case XCB_XKB_STATE_NOTIFY:
@@ -607,214 +950,233 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
     }
 }
 
-/*
- * Called when the properties on the root window change, e.g. when the screen
- * resolution changes. If so we update the window to cover the whole screen
- * and also redraw the image, if any.
- *
- */
-static void handle_screen_resize(void) {
-    xcb_get_geometry_cookie_t geomc;
-    xcb_get_geometry_reply_t *geom;
-    geomc = xcb_get_geometry(conn, screen->root);
-    if ((geom = xcb_get_geometry_reply(conn, geomc, 0)) == NULL)
-        return;
-
-    if (last_resolution[0] == geom->width &&
-        last_resolution[1] == geom->height) {
-        free(geom);
-        return;
+static bool verify_png_image(const char *image_path) {
+    if (!image_path) {
+        return false;
     }
 
-    last_resolution[0] = geom->width;
-    last_resolution[1] = geom->height;
-
-    free(geom);
-
-    redraw_screen();
-
-    uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-    xcb_configure_window(conn, win, mask, last_resolution);
-    xcb_flush(conn);
+    /* Check file exists and has correct PNG header */
+    FILE *png_file = fopen(image_path, "r");
+    if (png_file == NULL) {
+        fprintf(stderr, "Image file path \"%s\" cannot be opened: %s\n", image_path, strerror(errno));
+        return false;
+    }
+    unsigned char png_header[8];
+    memset(png_header, '\0', sizeof(png_header));
+    int bytes_read = fread(png_header, 1, sizeof(png_header), png_file);
+    fclose(png_file);
+    if (bytes_read != sizeof(png_header)) {
+        fprintf(stderr, "Could not read PNG header from \"%s\"\n", image_path);
+        return false;
+    }
 
-    randr_query(screen->root);
-    redraw_screen();
+    // Check PNG header according to the specification, available at:
+    // https://www.w3.org/TR/2003/REC-PNG-20031110/#5PNG-file-signature
+    static unsigned char PNG_REFERENCE_HEADER[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (memcmp(PNG_REFERENCE_HEADER, png_header, sizeof(png_header)) != 0) {
+        fprintf(stderr, "File \"%s\" does not start with a PNG header. i3lock currently only supports loading PNG files.\n", image_path);
+        return false;
+    }
+    return true;
 }
 
-static ssize_t read_raw_image_native(uint32_t *dest, FILE *src, size_t width, size_t height, int pixstride) {
-    ssize_t count = 0;
-    for (size_t y = 0; y < height; y++) {
-        size_t n = fread(&dest[y * pixstride], 1, width * 4, src);
-        count += n;
-        if (n < (size_t)(width * 4))
-            break;
+/*
+ * Returns the bounding box of all monitors, clipped to the root window.
+ *
+ */
+static Rect visible_area(void) {
+    if (xr_screens == 0)
+        return (Rect){0, 0, last_resolution[0], last_resolution[1]};
+
+    int x1 = last_resolution[0], y1 = last_resolution[1], x2 = 0, y2 = 0;
+    for (int i = 0; i < xr_screens; i++) {
+        const Rect *m = &xr_resolutions[i];
+        if (m->x < x1)
+            x1 = (m->x > 0 ? m->x : 0);
+        if (m->y < y1)
+            y1 = (m->y > 0 ? m->y : 0);
+        if (m->x + m->width > x2)
+            x2 = (m->x + m->width < (int)last_resolution[0] ? m->x + m->width : (int)last_resolution[0]);
+        if (m->y + m->height > y2)
+            y2 = (m->y + m->height < (int)last_resolution[1] ? m->y + m->height : (int)last_resolution[1]);
     }
+    if (x1 >= x2 || y1 >= y2)
+        return (Rect){0, 0, last_resolution[0], last_resolution[1]};
+    return (Rect){x1, y1, x2 - x1, y2 - y1};
+}
 
-    return count;
+static bool is_regular_file(const char *path) {
+    struct stat st;
+    return (stat(path, &st) == 0 && S_ISREG(st.st_mode));
 }
 
-struct raw_pixel_format {
-    int bpp;
-    int red;
-    int green;
-    int blue;
-};
-
-static ssize_t read_raw_image_fmt(uint32_t *dest, FILE *src, size_t width, size_t height, int pixstride,
-                                  struct raw_pixel_format fmt) {
-    unsigned char *buf = malloc(width * fmt.bpp);
-    if (buf == NULL)
-        return -1;
-
-    ssize_t count = 0;
-    for (size_t y = 0; y < height; y++) {
-        size_t n = fread(buf, 1, width * fmt.bpp, src);
-        count += n;
-        if (n < (size_t)(width * fmt.bpp))
-            break;
+/*
+ * Decides which part of the image (-i) to keep: only the part which is visible
+ * on the current monitors, unless the image is tiled or cannot be read again
+ * later (e.g. a pipe), when more of it becomes visible.
+ *
+ */
+static void choose_image_crop(void) {
+    image_cropped = (!tile && image_path != NULL && is_regular_file(image_path));
+    if (image_cropped)
+        image_crop = visible_area();
+}
+
+/*
+ * Decodes the image, cropped as chosen by choose_image_crop(). Does not touch
+ * X11 or the output state, so it can run on the image thread.
+ *
+ */
+static cairo_surface_t *decode_image(void) {
+    cairo_surface_t *image = NULL;
+    const Rect *crop = (image_cropped ? &image_crop : NULL);
+    /* Only regular files can be recognized again later. */
+    const bool cacheable = (cache_image && image_path != NULL && is_regular_file(image_path));
+
+    if (cacheable && (image = read_cached_image(image_path, image_raw_format, crop)) != NULL)
+        return image;
 
-        for (size_t x = 0; x < width; ++x) {
-            int idx = x * fmt.bpp;
-            dest[y * pixstride + x] = 0 |
-                                      (buf[idx + fmt.red]) << 16 |
-                                      (buf[idx + fmt.green]) << 8 |
-                                      (buf[idx + fmt.blue]);
+    if (image_raw_format != NULL && image_path != NULL) {
+        /* Read image. 'read_raw_image' returns NULL on error,
+         * so we don't have to handle errors here. */
+        image = read_raw_image(image_path, image_raw_format, crop);
+    } else if (verify_png_image(image_path)) {
+        /* Create a pixmap to render on, fill it with the background color */
+        image = cairo_image_surface_create_from_png(image_path);
+        /* In case loading failed, we just pretend no -i was specified. */
+        if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+            fprintf(stderr, "Could not load image \"%s\": %s\n",
+                    image_path, cairo_status_to_string(cairo_surface_status(image)));
+            image = NULL;
+        } else if (crop != NULL) {
+            image = crop_image(image, crop);
         }
     }
-
-    free(buf);
-    return count;
+    if (cacheable && image != NULL)
+        write_cached_image(image_path, image_raw_format, crop, image);
+    return image;
 }
 
-// Pre-defind pixel formats (<bytes per pixel>, <red pixel>, <green pixel>, <blue pixel>)
-static const struct raw_pixel_format raw_fmt_rgb = {3, 0, 1, 2};
-static const struct raw_pixel_format raw_fmt_rgbx = {4, 0, 1, 2};
-static const struct raw_pixel_format raw_fmt_xrgb = {4, 1, 2, 3};
-static const struct raw_pixel_format raw_fmt_bgr = {3, 2, 1, 0};
-static const struct raw_pixel_format raw_fmt_bgrx = {4, 2, 1, 0};
-static const struct raw_pixel_format raw_fmt_xbgr = {4, 3, 2, 1};
-
-static cairo_surface_t *read_raw_image(const char *image_path, const char *image_raw_format) {
-    cairo_surface_t *img;
-
-#define RAW_PIXFMT_MAXLEN 6
-#define STRINGIFY1(x) #x
-#define STRINGIFY(x) STRINGIFY1(x)
-    /* Parse format as <width>x<height>:<pixfmt> */
-    char pixfmt[RAW_PIXFMT_MAXLEN + 1];
-    size_t w, h;
-    const char *fmt = "%zux%zu:%" STRINGIFY(RAW_PIXFMT_MAXLEN) "s";
-    if (sscanf(image_raw_format, fmt, &w, &h, pixfmt) != 3) {
-        fprintf(stderr, "Invalid image format: \"%s\"\n", image_raw_format);
-        return NULL;
-    }
-#undef RAW_PIXFMT_MAXLEN
-#undef STRINGIFY1
-#undef STRINGIFY
-
-    /* Create image surface */
-    img = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
-    if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-        fprintf(stderr, "Could not create surface: %s\n",
-                cairo_status_to_string(cairo_surface_status(img)));
-        return NULL;
+/*
+ * Loads the image (-i), if any.
+ *
+ */
+static cairo_surface_t *load_image(void) {
+    if (screenshot) {
+        cairo_surface_t *image = take_screenshot(last_resolution);
+        if (image != NULL && blur_sigma > 0)
+            blur_image(image, blur_sigma);
+        if (image != NULL && pixelate_size > 1)
+            pixelate_image(image, pixelate_size);
+        return image;
     }
-    cairo_surface_flush(img);
+    choose_image_crop();
+    return decode_image();
+}
 
-    /* Use uint32_t* because cairo uses native endianness */
-    uint32_t *data = (uint32_t *)cairo_image_surface_get_data(img);
-    const int pixstride = cairo_image_surface_get_stride(img) / 4;
+/*
+ * Loads the image again if parts of it which were cropped off are visible on
+ * the new monitors.
+ *
+ */
+static void maybe_reload_image(void) {
+    if (img == NULL || !image_cropped || image_loading)
+        return;
 
-    FILE *f = fopen(image_path, "r");
-    if (f == NULL) {
-        fprintf(stderr, "Could not open image \"%s\": %s\n",
-                image_path, strerror(errno));
-        cairo_surface_destroy(img);
-        return NULL;
-    }
+    const Rect visible = visible_area();
+    if (visible.x >= image_crop.x && visible.y >= image_crop.y &&
+        visible.x + visible.width <= image_crop.x + image_crop.width &&
+        visible.y + visible.height <= image_crop.y + image_crop.height)
+        return;
 
-    /* Read the image, respecting cairo's stride, according to the pixfmt */
-    ssize_t size, count;
-    if (strcmp(pixfmt, "native") == 0) {
-        /* If the pixfmt is 'native', just read each line directly into the buffer */
-        size = w * h * 4;
-        count = read_raw_image_native(data, f, w, h, pixstride);
-    } else {
-        const struct raw_pixel_format *fmt = NULL;
-
-        if (strcmp(pixfmt, "rgb") == 0)
-            fmt = &raw_fmt_rgb;
-        else if (strcmp(pixfmt, "rgbx") == 0)
-            fmt = &raw_fmt_rgbx;
-        else if (strcmp(pixfmt, "xrgb") == 0)
-            fmt = &raw_fmt_xrgb;
-        else if (strcmp(pixfmt, "bgr") == 0)
-            fmt = &raw_fmt_bgr;
-        else if (strcmp(pixfmt, "bgrx") == 0)
-            fmt = &raw_fmt_bgrx;
-        else if (strcmp(pixfmt, "xbgr") == 0)
-            fmt = &raw_fmt_xbgr;
-
-        if (fmt == NULL) {
-            fprintf(stderr, "Unknown raw pixel format: %s\n", pixfmt);
-            fclose(f);
-            cairo_surface_destroy(img);
-            return NULL;
-        }
+    DEBUG("more of the image is visible now, loading it again\n");
+    cairo_surface_t *image = load_image();
+    if (image == NULL)
+        return;
+    cairo_surface_destroy(img);
+    img = image;
+    if (low_memory)
+        move_image_to_server();
+    free_bg_pixmap();
+}
 
-        size = w * h * fmt->bpp;
-        count = read_raw_image_fmt(data, f, w, h, pixstride, *fmt);
-    }
+static void *image_thread_main(void *arg) {
+    loaded_image = decode_image();
+    ev_async_send(main_loop, &image_ready_watcher);
+    return NULL;
+}
 
-    cairo_surface_mark_dirty(img);
+/*
+ * Waits for the image thread (--async-image) and swaps the image in, which
+ * renders the background again.
+ *
+ */
+static void finish_image_loading(void) {
+    if (!image_loading)
+        return;
+    pthread_join(image_thread, NULL);
+    image_loading = false;
+    profile_mark("image loaded (async)");
 
-    if (count < size) {
-        if (count < 0 || ferror(f)) {
-            fprintf(stderr, "Failed to read image \"%s\": %s\n",
-                    image_path, strerror(errno));
-            fclose(f);
-            cairo_surface_destroy(img);
-            return NULL;
-        } else {
-            /* Print a warning if the file contains less data than expected,
-             * but don't abort. It's useful to see how the image looks even if it's wrong. */
-            fprintf(stderr, "Warning: expected to read %zi bytes from \"%s\", read %zi\n",
-                    size, image_path, count);
-        }
-    }
+    img = loaded_image;
+    loaded_image = NULL;
+    if (img == NULL)
+        return;
+    if (low_memory)
+        move_image_to_server();
+    free_bg_pixmap();
+    /* The layout might have changed while loading. */
+    maybe_reload_image();
+    redraw_screen();
+}
 
-    fclose(f);
-    return img;
+static void image_ready_cb(EV_P_ ev_async *w, int revents) {
+    finish_image_loading();
 }
 
-static bool verify_png_image(const char *image_path) {
-    if (!image_path) {
+/*
+ * Starts decoding the image on a thread. Returns false if that is not possible.
+ *
+ */
+static bool start_image_thread(void) {
+    ev_async_init(&image_ready_watcher, image_ready_cb);
+    ev_async_start(main_loop, &image_ready_watcher);
+    /* The outputs are only looked at here, on the main thread. */
+    choose_image_crop();
+    if (pthread_create(&image_thread, NULL, image_thread_main, NULL) != 0) {
+        ev_async_stop(main_loop, &image_ready_watcher);
         return false;
     }
+    image_loading = true;
+    return true;
+}
 
-    /* Check file exists and has correct PNG header */
-    FILE *png_file = fopen(image_path, "r");
-    if (png_file == NULL) {
-        fprintf(stderr, "Image file path \"%s\" cannot be opened: %s\n", image_path, strerror(errno));
-        return false;
-    }
-    unsigned char png_header[8];
-    memset(png_header, '\0', sizeof(png_header));
-    int bytes_read = fread(png_header, 1, sizeof(png_header), png_file);
-    fclose(png_file);
-    if (bytes_read != sizeof(png_header)) {
-        fprintf(stderr, "Could not read PNG header from \"%s\"\n", image_path);
-        return false;
+/*
+ * Called after a batch of events which might have changed the screen layout
+ * (the root window’s size or the RandR outputs). If so we update the window to
+ * cover the whole screen and also redraw the image, if any.
+ *
+ */
+static void handle_screen_resize(void) {
+    screen_changed = false;
+
+    if (last_resolution[0] != root_resolution[0] ||
+        last_resolution[1] != root_resolution[1]) {
+        last_resolution[0] = root_resolution[0];
+        last_resolution[1] = root_resolution[1];
+
+        uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+        xcb_configure_window(conn, win, mask, last_resolution);
+        randr_invalidate();
     }
 
-    // Check PNG header according to the specification, available at:
-    // https://www.w3.org/TR/2003/REC-PNG-20031110/#5PNG-file-signature
-    static unsigned char PNG_REFERENCE_HEADER[8] = {137, 80, 78, 71, 13, 10, 26, 10};
-    if (memcmp(PNG_REFERENCE_HEADER, png_header, sizeof(png_header)) != 0) {
-        fprintf(stderr, "File \"%s\" does not start with a PNG header. i3lock currently only supports loading PNG files.\n", image_path);
-        return false;
+    /* Redraw only once the outputs are known, so that the unlock indicator
+     * is placed on the new monitors. */
+    if (randr_update(screen->root)) {
+        invalidate_render_state();
+        maybe_reload_image();
+        redraw_screen();
     }
-    return true;
 }
 
 #ifndef __OpenBSD__
@@ -864,7 +1226,9 @@ static void xcb_got_event(EV_P_ struct ev_io *w, int revents) {
  *
  */
 static void xcb_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+    TRACE_BEGIN(start);
     xcb_flush(conn);
+    TRACE_END(start, "xcb_flush");
 }
 
 /*
@@ -880,6 +1244,97 @@ static void maybe_close_sleep_lock_fd(void) {
         if (*endptr == 0) {
             close(fd);
         }
+        /* With --daemon, the next lock must not close whatever reuses it. */
+        unsetenv("XSS_SLEEP_LOCK_FD");
+    }
+}
+
+/*
+ * Forks (unless -n was given) right after starting, while the process is still
+ * small, instead of once the screen is locked. The parent waits until the
+ * child reports that the screen is locked (see report_locked()), so that
+ * "i3lock && echo mem > /sys/power/state" still works, and exits with an
+ * error if the child exits before locking.
+ *
+ */
+static void fork_early(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        err(EXIT_FAILURE, "socketpair");
+
+    pid_t pid = fork();
+    if (pid == -1)
+        err(EXIT_FAILURE, "fork");
+    if (pid != 0) {
+        /* Parent: only the child may hold on to the sleep lock. */
+        close(fds[1]);
+        maybe_close_sleep_lock_fd();
+        char c;
+        ssize_t n;
+        while ((n = read(fds[0], &c, 1)) == -1 && errno == EINTR)
+            ;
+        exit(n == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fds[0]);
+    (void)fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    lock_report_fd = fds[1];
+    trace_adopt();
+    profile_mark("forked");
+}
+
+/*
+ * Lets the parent process exit once the screen is locked, see fork_early().
+ * Just like before the parent could exit, the image (--async-image) is
+ * displayed first.
+ *
+ */
+static void report_locked(void) {
+    if (lock_report_fd == -1)
+        return;
+    finish_image_loading();
+    /* The parent might have been killed in the meantime. */
+    if (send(lock_report_fd, "", 1, MSG_NOSIGNAL) == -1)
+        DEBUG("could not notify the parent process: %s\n", strerror(errno));
+    close(lock_report_fd);
+    lock_report_fd = -1;
+}
+
+/*
+ * Handles an input event, which might have been deferred while verifying.
+ *
+ */
+static void handle_input_event(xcb_generic_event_t *event) {
+    TRACE_BEGIN(start);
+    if ((event->response_type & 0x7F) == XCB_KEY_PRESS) {
+        handle_key_press((xcb_key_press_event_t *)event);
+        TRACE_END_ARG(start, "handle_key_press", "keycode", ((xcb_key_press_event_t *)event)->detail);
+    } else {
+        process_xkb_event(event);
+        TRACE_END(start, "process_xkb_event");
+    }
+}
+
+/*
+ * Returns the name of the given event type for --trace.
+ *
+ */
+static const char *event_name(int type) {
+    switch (type) {
+        case XCB_KEY_PRESS:
+            return "KeyPress";
+        case XCB_KEY_RELEASE:
+            return "KeyRelease";
+        case XCB_EXPOSE:
+            return "Expose";
+        case XCB_VISIBILITY_NOTIFY:
+            return "VisibilityNotify";
+        case XCB_MAP_NOTIFY:
+            return "MapNotify";
+        case XCB_CONFIGURE_NOTIFY:
+            return "ConfigureNotify";
+        default:
+            return "X11 event";
     }
 }
 
@@ -894,7 +1349,14 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
     if (xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "X11 connection broke, did your server terminate?");
 
+    /* All queued events are handled before the next frame: typed characters
+     * only update the password buffer, the frame is rendered once before the
+     * event loop blocks again (see redraw_screen()). A verification started
+     * by Return defers the following key presses until it is done. */
+    TRACE_BEGIN(drain_start);
+    int drained = 0;
     while ((event = xcb_poll_for_event(conn)) != NULL) {
+        drained++;
         if (event->response_type == 0) {
             xcb_generic_error_t *error = (xcb_generic_error_t *)event;
             if (debug_mode)
@@ -906,10 +1368,13 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 
         /* Strip off the highest bit (set if the event is generated) */
         int type = (event->response_type & 0x7F);
+        TRACE_BEGIN(dispatch_start);
 
         switch (type) {
             case XCB_KEY_PRESS:
-                handle_key_press((xcb_key_press_event_t *)event);
+                if (defer_input_event(event))
+                    continue;
+                handle_input_event(event);
                 break;
 
             case XCB_VISIBILITY_NOTIFY:
@@ -917,52 +1382,84 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
                 break;
 
             case XCB_MAP_NOTIFY:
+                profile_mark("MapNotify received");
                 maybe_close_sleep_lock_fd();
-                if (!dont_fork) {
-                    /* After the first MapNotify, we never fork again. We don’t
-                     * expect to get another MapNotify, but better be sure… */
-                    dont_fork = true;
-
-                    /* In the parent process, we exit */
-                    if (fork() != 0)
-                        exit(0);
+                report_locked();
+                break;
 
-                    ev_loop_fork(EV_DEFAULT);
+            case XCB_CONFIGURE_NOTIFY: {
+                xcb_configure_notify_event_t *configure = (xcb_configure_notify_event_t *)event;
+                if (configure->window == screen->root) {
+                    root_resolution[0] = configure->width;
+                    root_resolution[1] = configure->height;
+                    screen_changed = true;
                 }
                 break;
+            }
 
-            case XCB_CONFIGURE_NOTIFY:
-                handle_screen_resize();
+            case XCB_EXPOSE:
+                /* With Present, the window contents are not restored from
+                 * the background pixmap, so present a frame again. */
+                if (present_enabled() && ((xcb_expose_event_t *)event)->count == 0)
+                    invalidate_screen();
                 break;
 
             default:
+                if (present_handle_event(event))
+                    break;
                 if (type == xkb_base_event) {
-                    process_xkb_event(event);
-                }
-                if (randr_base > -1 &&
-                    type == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
-                    randr_query(screen->root);
-                    handle_screen_resize();
+                    if (defer_input_event(event))
+                        continue;
+                    handle_input_event(event);
                 }
+                if (randr_handle_event(event))
+                    screen_changed = true;
         }
 
+        /* For key events, the X server’s timestamp allows attributing delays
+         * to the server or the connection. */
+        if (type == XCB_KEY_PRESS || type == XCB_KEY_RELEASE)
+            TRACE_END_ARG(dispatch_start, event_name(type), "server_time", ((xcb_key_press_event_t *)event)->time);
+        else
+            TRACE_END_ARG(dispatch_start, event_name(type), "type", type);
+
         free(event);
     }
+
+    restart_input_timers();
+
+    /* A resize or a docking station usually comes as a burst of events, which
+     * are handled together. */
+    if (screen_changed)
+        handle_screen_resize();
+    /* Likewise, changing the keymap usually sends several XKB events. */
+    if (keymap_changed)
+        reload_keymap();
+
+    if (drained > 0) {
+        trace_drain(drained);
+        TRACE_END_ARG(drain_start, "drain", "events", drained);
+    }
 }
 
 /*
- * This function is called from a fork()ed child and will raise the i3lock
- * window when the window is obscured, even when the main i3lock process is
- * blocked due to the authentication backend.
+ * Runs on its own thread with its own X11 connection and raises the i3lock
+ * window when the window is obscured, even when the main thread is blocked
+ * (e.g. by the X server or while rendering). Returns once the window is
+ * unmapped.
  *
  */
-static void raise_loop(xcb_window_t window) {
+static void *raise_loop(void *arg) {
+    const xcb_window_t window = *(xcb_window_t *)arg;
     xcb_connection_t *conn;
     xcb_generic_event_t *event;
     int screens;
 
-    if (xcb_connection_has_error((conn = xcb_connect(NULL, &screens))) > 0)
-        errx(EXIT_FAILURE, "Cannot open display");
+    if (xcb_connection_has_error((conn = xcb_connect(NULL, &screens))) > 0) {
+        DEBUG("raise_loop: cannot open display\n");
+        xcb_disconnect(conn);
+        return NULL;
+    }
 
     /* We need to know about the window being obscured or getting destroyed. */
     xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK,
@@ -990,12 +1487,12 @@ static void raise_loop(xcb_window_t window) {
             case XCB_UNMAP_NOTIFY:
                 DEBUG("UnmapNotify for 0x%08x\n", (((xcb_unmap_notify_event_t *)event)->window));
                 if (((xcb_unmap_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
+                    goto done;
                 break;
             case XCB_DESTROY_NOTIFY:
                 DEBUG("DestroyNotify for 0x%08x\n", (((xcb_destroy_notify_event_t *)event)->window));
                 if (((xcb_destroy_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
+                    goto done;
                 break;
             default:
                 DEBUG("Unhandled event type %d\n", type);
@@ -1003,13 +1500,209 @@ static void raise_loop(xcb_window_t window) {
         }
         free(event);
     }
+
+done:
+    free(event);
+    xcb_disconnect(conn);
+    return NULL;
+}
+
+/*
+ * Grabs pointer and keyboard, displaying the "locking…" message while trying.
+ * If that takes too long, i3lock takes the focus, which closes context menus
+ * that might prevent the grab.
+ *
+ */
+static bool grab_input(void) {
+    auth_state = STATE_AUTH_LOCK;
+    if (grab_pointer_and_keyboard(conn, screen, cursor, GRAB_TIMEOUT))
+        return true;
+
+    DEBUG("stole focus from X11 window 0x%08x\n", stolen_focus);
+
+    /* Set the focus to i3lock, possibly closing context menus which would
+     * otherwise prevent us from grabbing keyboard/pointer.
+     *
+     * We cannot use set_focused_window because _NET_ACTIVE_WINDOW only
+     * works for managed windows, but i3lock uses an unmanaged window
+     * (override_redirect=1). */
+    xcb_set_input_focus(conn, XCB_INPUT_FOCUS_PARENT /* revert_to */, win, XCB_CURRENT_TIME);
+    return grab_pointer_and_keyboard(conn, screen, cursor, GRAB_TIMEOUT_AFTER_FOCUS);
+}
+
+/*
+ * Starts the thread which keeps the window on top, see raise_loop().
+ *
+ */
+static void start_raise_loop(void) {
+    static pthread_t raise_thread;
+    static bool raise_thread_started = false;
+    static xcb_window_t raise_window;
+
+    /* With --daemon, the previous thread returns on the UnmapNotify which
+     * was sent when the screen was unlocked. */
+    if (raise_thread_started)
+        pthread_join(raise_thread, NULL);
+
+    raise_window = win;
+    /* A failure is intentionally ignored here: While the thread is useful
+     * for preventing other windows from popping up while i3lock blocks, it
+     * is not critical. */
+    raise_thread_started = (pthread_create(&raise_thread, NULL, raise_loop, &raise_window) == 0);
+    if (!raise_thread_started)
+        DEBUG("could not start the raise_loop thread\n");
+}
+
+/*
+ * Locks the screen from standby (--daemon): maps the prepared window and grabs
+ * pointer and keyboard. Returns true if the screen is locked.
+ *
+ */
+static bool lock_screen(void) {
+    /* Requests while grabbing (which runs the event loop) are ignored. */
+    static bool locking = false;
+    if (locked || locking)
+        return locked;
+    DEBUG("lock requested\n");
+    locking = true;
+    /* PAM has been idle since the last unlock, possibly for hours. */
+    if (daemon_mode)
+        start_pam_warmup();
+
+    if (screenshot) {
+        /* The screen looks different every time. It is captured (and the
+         * background rendered) while the window is still unmapped. */
+        cairo_surface_t *image = load_image();
+        if (image != NULL) {
+            cairo_surface_destroy(img);
+            img = image;
+            if (low_memory)
+                move_image_to_server();
+            free_bg_pixmap();
+            redraw_screen();
+            render_pending_frame();
+        }
+    }
+
+    xcb_get_property_cookie_t focus_cookie = request_focused_window(conn, screen->root);
+    map_fullscreen_window(conn, win);
+    stolen_focus = find_focused_window(conn, focus_cookie);
+
+    /* Locking might have been requested while the layout changed. */
+    render_pending_frame();
+
+    if (!grab_input()) {
+        fprintf(stderr, "[i3lock] Cannot grab pointer/keyboard\n");
+        xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+        xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+        xcb_unmap_window(conn, win);
+        auth_state = STATE_AUTH_IDLE;
+        redraw_screen();
+        xcb_flush(conn);
+        locking = false;
+        return false;
+    }
+
+    start_raise_loop();
+    locking = false;
+    locked = true;
+    daemon_locked();
+    auth_state = STATE_AUTH_IDLE;
+    redraw_screen();
+    DEBUG("locked\n");
+    return true;
+}
+
+/*
+ * Returns to standby after unlocking (--daemon): the window is unmapped again
+ * and everything is reset for the next lock, keeping the image, the rendered
+ * background, the keymap and the PAM handle.
+ *
+ */
+static void enter_standby(void) {
+    locked = false;
+    first_auth = true;
+
+    xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+    /* The raise_loop() thread returns on the UnmapNotify. */
+    xcb_unmap_window(conn, win);
+    if (stolen_focus != XCB_NONE) {
+        DEBUG("restoring focus to X11 window 0x%08x\n", stolen_focus);
+        set_focused_window(conn, screen->root, stolen_focus);
+        stolen_focus = XCB_NONE;
+    }
+
+    /* Input which was typed after the correct password is not for us. */
+    for (int i = 0; i < num_deferred_events; i++)
+        free(deferred_events[i]);
+    num_deferred_events = 0;
+
+    /* No frame is rendered in standby but the idle frame below. */
+    input_timers_pending = false;
+    STOP_TIMER(redraw_timeout);
+    STOP_TIMER(clear_auth_wrong_timeout);
+    STOP_TIMER(clear_indicator_timeout);
+    STOP_TIMER(discard_passwd_timeout);
+    retry_verification = false;
+    clear_input();
+    failed_attempts = 0;
+    free(modifier_string);
+    modifier_string = NULL;
+    unlock_state = STATE_STARTED;
+    auth_state = STATE_AUTH_IDLE;
+
+    /* Render the idle frame right away, so that the next lock only needs to
+     * map the window. */
+    redraw_screen();
+    xcb_flush(conn);
+
+    daemon_unlocked();
+    DEBUG("unlocked, back to standby\n");
+}
+
+static void lock_signal_cb(EV_P_ ev_signal *w, int revents) {
+    (void)lock_screen();
+}
+
+static void exit_signal_cb(EV_P_ ev_signal *w, int revents) {
+    /* Exits like after unlocking (also while locked, just like killing i3lock
+     * without --daemon), which removes the socket. */
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/*
+ * Starts accepting lock requests (--daemon): SIGUSR1 and the UNIX socket.
+ *
+ */
+static void start_daemon(void) {
+    static ev_signal lock_signal, term_signal, int_signal;
+
+    ev_signal_init(&lock_signal, lock_signal_cb, SIGUSR1);
+    ev_signal_start(main_loop, &lock_signal);
+    ev_signal_init(&term_signal, exit_signal_cb, SIGTERM);
+    ev_signal_start(main_loop, &term_signal);
+    ev_signal_init(&int_signal, exit_signal_cb, SIGINT);
+    ev_signal_start(main_loop, &int_signal);
+
+    if (daemon_socket == NULL) {
+        const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+        if (runtime_dir == NULL || *runtime_dir == '\0') {
+            DEBUG("XDG_RUNTIME_DIR is not set, only SIGUSR1 locks the screen\n");
+            return;
+        }
+        if (asprintf(&daemon_socket, "%s/i3lock.socket", runtime_dir) == -1)
+            err(EXIT_FAILURE, "asprintf");
+    }
+    if (!daemon_listen(daemon_socket, lock_screen))
+        errx(EXIT_FAILURE, "Could not listen for lock requests");
 }
 
 int main(int argc, char *argv[]) {
+    profile_mark("start");
+
     struct passwd *pw;
     char *username;
-    char *image_path = NULL;
-    char *image_raw_format = NULL;
 #ifndef __OpenBSD__
     int ret;
     struct pam_conv conv = {conv_callback, NULL};
@@ -1034,6 +1727,20 @@ int main(int argc, char *argv[]) {
         {"ignore-empty-password", no_argument, NULL, 'e'},
         {"inactivity-timeout", required_argument, NULL, 'I'},
         {"show-failed-attempts", no_argument, NULL, 'f'},
+        {"present", no_argument, NULL, 0},
+        {"xrender", no_argument, NULL, 0},
+        {"profile-startup", no_argument, NULL, 0},
+        {"max-fps", required_argument, NULL, 0},
+        {"trace", required_argument, NULL, 0},
+        {"low-memory", no_argument, NULL, 0},
+        {"daemon", optional_argument, NULL, 0},
+        {"async-image", no_argument, NULL, 0},
+        {"cache-image", no_argument, NULL, 0},
+        {"screenshot", no_argument, NULL, 0},
+        {"blur", required_argument, NULL, 0},
+        {"pixelate", required_argument, NULL, 0},
+        {"pam-warmup", no_argument, NULL, 0},
+        {"auth-stats", required_argument, NULL, 0},
         {NULL, no_argument, NULL, 0}};
 
     if ((pw = getpwuid(getuid())) == NULL)
@@ -1055,8 +1762,10 @@ int main(int argc, char *argv[]) {
                 beep = true;
                 break;
             case 's':
-                if (sscanf(optarg, "%d", &show_on_screen) != 1 || show_on_screen < 0)
-                    errx(EXIT_FAILURE, "invalid screen, must be a positive index\n");
+                if (strcmp(optarg, "all") == 0)
+                    show_on_screen = SHOW_ON_ALL_SCREENS;
+                else if (sscanf(optarg, "%d", &show_on_screen) != 1 || show_on_screen < 0)
+                    errx(EXIT_FAILURE, "invalid screen, must be a positive index or \"all\"\n");
                 break;
             case 'd':
                 fprintf(stderr, "DPMS support has been removed from i3lock. Please see the manpage i3lock(1).\n");
@@ -1103,6 +1812,51 @@ int main(int argc, char *argv[]) {
                     debug_mode = true;
                 else if (strcmp(longopts[longoptind].name, "raw") == 0)
                     image_raw_format = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "present") == 0)
+                    use_present = true;
+                else if (strcmp(longopts[longoptind].name, "xrender") == 0)
+                    use_xrender = true;
+                else if (strcmp(longopts[longoptind].name, "profile-startup") == 0)
+                    profile_startup = true;
+                else if (strcmp(longopts[longoptind].name, "max-fps") == 0) {
+                    int max_fps;
+                    if (sscanf(optarg, "%d", &max_fps) != 1 || max_fps < 0)
+                        errx(EXIT_FAILURE, "invalid maximum frame rate, must be a positive number\n");
+                    min_frame_interval = (max_fps > 0 ? 1.0 / max_fps : 0);
+                }
+                else if (strcmp(longopts[longoptind].name, "trace") == 0) {
+                    if (!trace_open(optarg))
+                        errx(EXIT_FAILURE, "Could not enable tracing");
+                }
+                else if (strcmp(longopts[longoptind].name, "low-memory") == 0)
+                    low_memory = true;
+                else if (strcmp(longopts[longoptind].name, "async-image") == 0)
+                    async_image = true;
+                else if (strcmp(longopts[longoptind].name, "cache-image") == 0)
+                    cache_image = true;
+                else if (strcmp(longopts[longoptind].name, "screenshot") == 0)
+                    screenshot = true;
+                else if (strcmp(longopts[longoptind].name, "blur") == 0) {
+                    if (sscanf(optarg, "%d", &blur_sigma) != 1 || blur_sigma < 0 || blur_sigma > 1000)
+                        errx(EXIT_FAILURE, "invalid blur radius, must be a number from 0 to 1000\n");
+                }
+                else if (strcmp(longopts[longoptind].name, "pixelate") == 0) {
+                    if (sscanf(optarg, "%d", &pixelate_size) != 1 || pixelate_size < 0)
+                        errx(EXIT_FAILURE, "invalid pixel size, must be a positive number\n");
+                }
+                else if (strcmp(longopts[longoptind].name, "pam-warmup") == 0)
+                    pam_warmup = true;
+                else if (strcmp(longopts[longoptind].name, "auth-stats") == 0) {
+                    /* Only telemetry: never refuse to lock over it. */
+                    if (!auth_stats_open(optarg))
+                        fprintf(stderr, "[i3lock] authentication statistics are disabled\n");
+                }
+                else if (strcmp(longopts[longoptind].name, "daemon") == 0) {
+                    daemon_mode = true;
+                    dont_fork = true;
+                    if (optarg != NULL)
+                        daemon_socket = strdup(optarg);
+                }
                 break;
             case 'f':
                 show_failed_attempts = true;
@@ -1113,6 +1867,15 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (screenshot && image_path != NULL)
+        errx(EXIT_FAILURE, "--screenshot and --image cannot be combined");
+    if (!screenshot && (blur_sigma > 0 || pixelate_size > 0))
+        errx(EXIT_FAILURE, "--blur and --pixelate require --screenshot");
+
+    /* Before anything large is allocated, which would make fork() slower. */
+    if (!dont_fork)
+        fork_early();
+
     /* We need (relatively) random numbers for highlighting a random part of
      * the unlock indicator upon keypresses. */
     srand(time(NULL));
@@ -1124,6 +1887,9 @@ int main(int argc, char *argv[]) {
 
     if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
         errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+
+    /* Overlaps with connecting to X11 and loading the image. */
+    start_pam_warmup();
 #endif
 
 /* Using mlock() as non-super-user seems only possible in Linux.
@@ -1144,6 +1910,26 @@ int main(int argc, char *argv[]) {
     if ((conn = xcb_connect(NULL, &screennr)) == NULL ||
         xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
+    profile_mark("connected to X11");
+
+    /* Issue all requests whose replies are needed during startup up front,
+     * so that they travel in as few round trips as possible: the extension
+     * queries, the atoms, the X resources and the RandR version. */
+    xcb_prefetch_extension_data(conn, &xcb_xkb_id);
+    xcb_prefetch_extension_data(conn, &xcb_randr_id);
+    xcb_prefetch_extension_data(conn, &xcb_xinerama_id);
+    if (use_present)
+        xcb_prefetch_extension_data(conn, &xcb_present_id);
+    if (use_xrender)
+        xcb_prefetch_extension_data(conn, &xcb_render_id);
+    xcb_prefetch_extension_data(conn, &xcb_shm_id);
+
+    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+
+    prefetch_atoms(conn);
+    prefetch_dpi();
+    randr_init(screen->root);
+    xcb_flush(conn);
 
     if (xkb_x11_setup_xkb_extension(conn,
                                     XKB_X11_MIN_MAJOR_XKB_VERSION,
@@ -1169,9 +1955,10 @@ int main(int argc, char *argv[]) {
          XCB_XKB_EVENT_TYPE_MAP_NOTIFY |
          XCB_XKB_EVENT_TYPE_STATE_NOTIFY);
 
+    xkb_device_id = xkb_x11_get_core_keyboard_device_id(conn);
     xcb_xkb_select_events(
         conn,
-        xkb_x11_get_core_keyboard_device_id(conn),
+        xkb_device_id,
         required_events,
         0,
         required_events,
@@ -1179,108 +1966,113 @@ int main(int argc, char *argv[]) {
         required_map_parts,
         0);
 
-    /* When we cannot initially load the keymap, we better exit */
-    if (!load_keymap())
-        errx(EXIT_FAILURE, "Could not load keymap");
+    profile_mark("XKB set up");
 
-    const char *locale = getenv("LC_ALL");
-    if (!locale || !*locale)
-        locale = getenv("LC_CTYPE");
-    if (!locale || !*locale)
-        locale = getenv("LANG");
-    if (!locale || !*locale) {
-        if (debug_mode)
-            fprintf(stderr, "Can't detect your locale, fallback to C\n");
-        locale = "C";
-    }
-
-    load_compose_table(locale);
-
-    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+    /* By now, the _NET_ACTIVE_WINDOW atom has arrived. */
+    xcb_get_property_cookie_t focus_cookie = request_focused_window(conn, screen->root);
 
     init_dpi();
-
-    randr_init(&randr_base, screen->root);
     randr_query(screen->root);
+    profile_mark("DPI and outputs queried");
 
-    last_resolution[0] = screen->width_in_pixels;
-    last_resolution[1] = screen->height_in_pixels;
+    last_resolution[0] = root_resolution[0] = screen->width_in_pixels;
+    last_resolution[1] = root_resolution[1] = screen->height_in_pixels;
 
     xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
                                  (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
 
-    if (image_raw_format != NULL && image_path != NULL) {
-        /* Read image. 'read_raw_image' returns NULL on error,
-         * so we don't have to handle errors here. */
-        img = read_raw_image(image_path, image_raw_format);
-    } else if (verify_png_image(image_path)) {
-        /* Create a pixmap to render on, fill it with the background color */
-        img = cairo_image_surface_create_from_png(image_path);
-        /* In case loading failed, we just pretend no -i was specified. */
-        if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-            fprintf(stderr, "Could not load image \"%s\": %s\n",
-                    image_path, cairo_status_to_string(cairo_surface_status(img)));
-            img = NULL;
+    /* Initialize the libev event loop. The image thread reports to it, and
+     * the grabs are retried on its timers. */
+    main_loop = EV_DEFAULT;
+    if (main_loop == NULL)
+        errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?");
+
+    if (!async_image || image_path == NULL || !start_image_thread()) {
+        img = load_image();
+        profile_mark("image loaded");
+        profile_memory("after loading the image");
+
+        if (low_memory) {
+            move_image_to_server();
+            profile_mark("image uploaded");
         }
     }
 
-    free(image_path);
-    free(image_raw_format);
-
-    /* Pixmap on which the image is rendered to (if any) */
-    xcb_pixmap_t bg_pixmap = create_bg_pixmap(conn, screen, last_resolution, color);
-    draw_image(bg_pixmap, last_resolution);
+    if (image_loading) {
+        /* Cover the screen with the background color right away. The unlock
+         * indicator and the image follow with the first frames. */
+        win = create_fullscreen_window(conn, screen, color, XCB_NONE);
+    } else {
+        /* Pixmap on which the image is rendered to (if any) */
+        xcb_pixmap_t bg_pixmap = create_bg_pixmap(conn, screen, last_resolution, NULL);
+        draw_image(bg_pixmap, last_resolution);
+        profile_mark("background drawn");
+
+        /* Open the fullscreen window, already with the correct pixmap in
+         * place. With --daemon, it is only mapped when locking. */
+        win = create_fullscreen_window(conn, screen, color, bg_pixmap);
+        xcb_free_pixmap(conn, bg_pixmap);
+    }
+    if (daemon_mode) {
+        xcb_discard_reply(conn, focus_cookie.sequence);
+    } else {
+        map_fullscreen_window(conn, win);
+        profile_mark("window mapped");
 
-    xcb_window_t stolen_focus = find_focused_window(conn, screen->root);
+        /* The focus was requested before mapping our window, so this is the
+         * window which was focused before locking. */
+        stolen_focus = find_focused_window(conn, focus_cookie);
+    }
 
-    /* Open the fullscreen window, already with the correct pixmap in place */
-    win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-    xcb_free_pixmap(conn, bg_pixmap);
+    /* Falls back to updating the window background pixmap if Present is
+     * not available. */
+    if (use_present)
+        (void)present_init(conn, win);
+    if (use_xrender)
+        (void)xrender_init(conn, screen);
 
     cursor = create_cursor(conn, screen, win, curs_choice);
 
-    /* Display the "locking…" message while trying to grab the pointer/keyboard. */
-    auth_state = STATE_AUTH_LOCK;
-    if (!grab_pointer_and_keyboard(conn, screen, cursor, 1000)) {
-        DEBUG("stole focus from X11 window 0x%08x\n", stolen_focus);
-
-        /* Set the focus to i3lock, possibly closing context menus which would
-         * otherwise prevent us from grabbing keyboard/pointer.
-         *
-         * We cannot use set_focused_window because _NET_ACTIVE_WINDOW only
-         * works for managed windows, but i3lock uses an unmanaged window
-         * (override_redirect=1). */
-        xcb_set_input_focus(conn, XCB_INPUT_FOCUS_PARENT /* revert_to */, win, XCB_CURRENT_TIME);
-        if (!grab_pointer_and_keyboard(conn, screen, cursor, 9000)) {
+    if (!daemon_mode) {
+        profile_mark("cursor created");
+        if (!grab_input()) {
             auth_state = STATE_I3LOCK_LOCK_FAILED;
             redraw_screen();
+            render_pending_frame();
             sleep(1);
             errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
         }
-    }
+        profile_mark("pointer and keyboard grabbed");
 
-    pid_t pid = fork();
-    /* The pid == -1 case is intentionally ignored here:
-     * While the child process is useful for preventing other windows from
-     * popping up while i3lock blocks, it is not critical. */
-    if (pid == 0) {
-        /* Child */
-        close(xcb_get_file_descriptor(conn));
-        maybe_close_sleep_lock_fd();
-        raise_loop(win);
-        exit(EXIT_SUCCESS);
+        start_raise_loop();
+        locked = true;
     }
 
-    /* Load the keymap again to sync the current modifier state. Since we first
-     * loaded the keymap, there might have been changes, but starting from now,
-     * we should get all key presses/releases due to having grabbed the
-     * keyboard. */
-    (void)load_keymap();
+    /* The keymap is only needed once we receive key presses, so it is loaded
+     * now that the screen is covered. This also gets the current modifier
+     * state: starting from now, we should get all key presses/releases due
+     * to having grabbed the keyboard.
+     *
+     * When we cannot initially load the keymap, we better exit */
+    if (!load_keymap())
+        errx(EXIT_FAILURE, "Could not load keymap");
 
-    /* Initialize the libev event loop. */
-    main_loop = EV_DEFAULT;
-    if (main_loop == NULL)
-        errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?");
+    const char *locale = getenv("LC_ALL");
+    if (!locale || !*locale)
+        locale = getenv("LC_CTYPE");
+    if (!locale || !*locale)
+        locale = getenv("LANG");
+    if (!locale || !*locale) {
+        if (debug_mode)
+            fprintf(stderr, "Can't detect your locale, fallback to C\n");
+        locale = "C";
+    }
+
+    /* The compose table is loaded once the screen is locked. */
+    compose_locale = locale;
+    ev_idle_init(&compose_idle_watcher, compose_idle_cb);
+    ev_idle_start(main_loop, &compose_idle_watcher);
+    profile_mark("keymap loaded");
 
     /* Explicitly call the screen redraw in case "locking…" message was displayed */
     auth_state = STATE_AUTH_IDLE;
@@ -1299,11 +2091,26 @@ int main(int argc, char *argv[]) {
     ev_prepare_init(xcb_prepare, xcb_prepare_cb);
     ev_prepare_start(main_loop, xcb_prepare);
 
+    auth_done_watcher = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(auth_done_watcher, auth_done_cb);
+    ev_async_start(main_loop, auth_done_watcher);
+
+    if (daemon_mode)
+        start_daemon();
+
     /* Invoke the event callback once to catch all the events which were
      * received up until now. ev will only pick up new events (when the X11
      * file descriptor becomes readable). */
     ev_invoke(main_loop, xcb_check, 0);
+    profile_report();
+    profile_memory("once locked");
     ev_loop(main_loop, 0);
+    profile_memory("when unlocking");
+
+    /* The PAM handle must not be freed while it is still in use. */
+    join_pam_threads();
+    if (daemon_mode)
+        daemon_cleanup();
 
 #ifndef __OpenBSD__
     if (pam_cleanup) {
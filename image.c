@@ -0,0 +1,768 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * image.c: loading the image which is displayed while the screen is locked.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <xcb/xcb.h>
+#include <cairo.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "i3lock.h"
+#include "randr.h"
+#include "image.h"
+
+extern bool debug_mode;
+
+struct raw_pixel_format {
+    int bpp;
+    int red;
+    int green;
+    int blue;
+};
+
+// Pre-defind pixel formats (<bytes per pixel>, <red pixel>, <green pixel>, <blue pixel>)
+static const struct raw_pixel_format raw_fmt_rgb = {3, 0, 1, 2};
+static const struct raw_pixel_format raw_fmt_rgbx = {4, 0, 1, 2};
+static const struct raw_pixel_format raw_fmt_xrgb = {4, 1, 2, 3};
+static const struct raw_pixel_format raw_fmt_bgr = {3, 2, 1, 0};
+static const struct raw_pixel_format raw_fmt_bgrx = {4, 2, 1, 0};
+static const struct raw_pixel_format raw_fmt_xbgr = {4, 3, 2, 1};
+
+/* Converts one row of pixels in the given format into cairo’s native
+ * 0x00RRGGBB format. */
+typedef void (*swizzle_func_t)(uint32_t *dest, const uint8_t *src, size_t width,
+                               const struct raw_pixel_format *fmt, const uint8_t *mask);
+
+static void swizzle_scalar(uint32_t *dest, const uint8_t *src, size_t width,
+                           const struct raw_pixel_format *fmt, const uint8_t *mask) {
+    for (size_t x = 0; x < width; ++x) {
+        const uint8_t *px = src + x * fmt->bpp;
+        dest[x] = 0 |
+                  (px[fmt->red]) << 16 |
+                  (px[fmt->green]) << 8 |
+                  (px[fmt->blue]);
+    }
+}
+
+#if HAVE_X86_SIMD
+/*
+ * The SSSE3/AVX2 kernels use a byte shuffle which maps the source bytes of 4
+ * pixels (16 bytes for 4 bpp, 12 bytes for 3 bpp) to the bytes of 4 native
+ * pixels. The shuffle mask is derived from the pixel format, see
+ * build_shuffle_mask().
+ *
+ */
+__attribute__((target("ssse3"))) static void swizzle_ssse3(uint32_t *dest, const uint8_t *src, size_t width,
+                                                           const struct raw_pixel_format *fmt, const uint8_t *mask) {
+    const __m128i shuffle = _mm_loadu_si128((const __m128i *)mask);
+    /* Each iteration loads 16 bytes, but only consumes 4 pixels. Stop early
+     * enough to never read past the end of the row. */
+    size_t x = 0;
+    for (; x * fmt->bpp + 16 <= width * fmt->bpp; x += 4) {
+        const __m128i in = _mm_loadu_si128((const __m128i *)(src + x * fmt->bpp));
+        _mm_storeu_si128((__m128i *)(dest + x), _mm_shuffle_epi8(in, shuffle));
+    }
+    swizzle_scalar(dest + x, src + x * fmt->bpp, width - x, fmt, mask);
+}
+
+__attribute__((target("avx2"))) static void swizzle_avx2(uint32_t *dest, const uint8_t *src, size_t width,
+                                                         const struct raw_pixel_format *fmt, const uint8_t *mask) {
+    /* vpshufb shuffles within each 128-bit lane, so each lane gets the same
+     * mask and its own 4 source pixels. */
+    const __m128i lane_mask = _mm_loadu_si128((const __m128i *)mask);
+    const __m256i shuffle = _mm256_broadcastsi128_si256(lane_mask);
+    const size_t lane_bytes = 4 * fmt->bpp;
+    size_t x = 0;
+    for (; x * fmt->bpp + lane_bytes + 16 <= width * fmt->bpp; x += 8) {
+        const uint8_t *in = src + x * fmt->bpp;
+        const __m256i pixels = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+            _mm_loadu_si128((const __m128i *)(in + lane_bytes)), 1);
+        _mm256_storeu_si256((__m256i *)(dest + x), _mm256_shuffle_epi8(pixels, shuffle));
+    }
+    swizzle_ssse3(dest + x, src + x * fmt->bpp, width - x, fmt, mask);
+}
+#endif
+
+#if HAVE_NEON
+static void swizzle_neon(uint32_t *dest, const uint8_t *src, size_t width,
+                         const struct raw_pixel_format *fmt, const uint8_t *mask) {
+    size_t x = 0;
+    uint8x16x4_t out;
+    /* Byte order of a native little-endian pixel: blue, green, red, unused. */
+    out.val[3] = vdupq_n_u8(0);
+    if (fmt->bpp == 3) {
+        for (; x + 16 <= width; x += 16) {
+            const uint8x16x3_t in = vld3q_u8(src + x * 3);
+            out.val[0] = in.val[fmt->blue];
+            out.val[1] = in.val[fmt->green];
+            out.val[2] = in.val[fmt->red];
+            vst4q_u8((uint8_t *)(dest + x), out);
+        }
+    } else {
+        for (; x + 16 <= width; x += 16) {
+            const uint8x16x4_t in = vld4q_u8(src + x * 4);
+            out.val[0] = in.val[fmt->blue];
+            out.val[1] = in.val[fmt->green];
+            out.val[2] = in.val[fmt->red];
+            vst4q_u8((uint8_t *)(dest + x), out);
+        }
+    }
+    swizzle_scalar(dest + x, src + x * fmt->bpp, width - x, fmt, mask);
+}
+#endif
+
+/*
+ * Builds the byte shuffle mask for 4 pixels of the given format: output byte
+ * i is taken from input byte mask[i], 0x80 produces a zero byte.
+ *
+ */
+static void build_shuffle_mask(const struct raw_pixel_format *fmt, uint8_t *mask) {
+    for (int i = 0; i < 4; i++) {
+        mask[i * 4 + 0] = i * fmt->bpp + fmt->blue;
+        mask[i * 4 + 1] = i * fmt->bpp + fmt->green;
+        mask[i * 4 + 2] = i * fmt->bpp + fmt->red;
+        mask[i * 4 + 3] = 0x80;
+    }
+}
+
+/*
+ * Picks the fastest conversion kernel supported by the CPU.
+ *
+ */
+static swizzle_func_t select_swizzle_kernel(const char **name) {
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return swizzle_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        *name = "ssse3";
+        return swizzle_ssse3;
+    }
+#endif
+#if HAVE_NEON
+    *name = "neon";
+    return swizzle_neon;
+#endif
+    *name = "scalar";
+    return swizzle_scalar;
+}
+
+/* The contents of a raw image file (or the part of it which is needed), either
+ * mapped into memory or read into a malloc’d buffer. */
+typedef struct {
+    /* The requested part of the file. */
+    uint8_t *data;
+    size_t size;
+    /* The mapping or allocation, which data points into. */
+    uint8_t *base;
+    size_t mapped_size;
+} raw_file_t;
+
+/*
+ * Reads length bytes starting at offset. Regular files are mapped into memory
+ * if possible, so that only the pages which are used are ever read. Anything
+ * else (e.g. a pipe, see the --raw example in the manpage) is read with large
+ * read() calls. Only regular files can be read from an offset.
+ *
+ */
+static bool read_raw_file(int fd, size_t offset, size_t length, raw_file_t *file) {
+    struct stat st;
+    memset(file, '\0', sizeof(raw_file_t));
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        /* Mapped privately and writable: a cache entry’s surface may be
+         * used directly without ever modifying the file. */
+        void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            const size_t start = ((size_t)st.st_size < offset ? (size_t)st.st_size : offset);
+            file->base = data;
+            file->mapped_size = st.st_size;
+            file->data = file->base + start;
+            file->size = (st.st_size - start < length ? st.st_size - start : length);
+            return true;
+        }
+    }
+
+    if (offset > 0 && lseek(fd, offset, SEEK_SET) == -1)
+        return false;
+
+    if ((file->base = malloc(length > 0 ? length : 1)) == NULL)
+        return false;
+    file->data = file->base;
+    while (file->size < length) {
+        ssize_t n = read(fd, file->data + file->size, length - file->size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            free(file->base);
+            file->base = file->data = NULL;
+            return false;
+        }
+        if (n == 0)
+            break;
+        file->size += n;
+    }
+    return true;
+}
+
+static const cairo_user_data_key_t raw_file_key;
+
+static void release_raw_file(raw_file_t *file) {
+    if (file->mapped_size > 0)
+        munmap(file->base, file->mapped_size);
+    else
+        free(file->base);
+}
+
+static void free_raw_file(void *data) {
+    release_raw_file(data);
+    free(data);
+}
+
+/*
+ * Creates an image surface which directly uses the file’s contents. This
+ * works if the file contains enough data, since the stride of a 32 bpp cairo
+ * image is always width * 4.
+ *
+ * Only used for the image cache: its entries are only ever replaced by
+ * rename(), never modified in place. A mapping of any other file (e.g. a
+ * --raw image regenerated by a screenshot script) would raise SIGBUS on the
+ * next access once the file is truncated, which would unlock the screen.
+ *
+ */
+static cairo_surface_t *create_surface_for_file(raw_file_t *file, cairo_format_t format, size_t w, size_t h) {
+    const int stride = cairo_format_stride_for_width(format, w);
+    if (stride < 0 || (size_t)stride != w * 4 || file->size < w * h * 4)
+        return NULL;
+
+    raw_file_t *owned = malloc(sizeof(raw_file_t));
+    if (owned == NULL)
+        return NULL;
+    *owned = *file;
+
+    cairo_surface_t *surface = cairo_image_surface_create_for_data(file->data, format, w, h, stride);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+        cairo_surface_set_user_data(surface, &raw_file_key, owned, free_raw_file) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        free(owned);
+        return NULL;
+    }
+    return surface;
+}
+
+/* The part of an image which is kept, in image coordinates. */
+typedef struct {
+    size_t x, y, width, height;
+} region_t;
+
+/*
+ * Returns the part of a width x height image (painted at the origin) which is
+ * within crop, or the entire image without a crop.
+ *
+ */
+static region_t visible_region(const Rect *crop, size_t width, size_t height) {
+    region_t r = {0, 0, width, height};
+    if (crop == NULL)
+        return r;
+
+    const size_t x1 = (crop->x > 0 ? (size_t)crop->x : 0);
+    const size_t y1 = (crop->y > 0 ? (size_t)crop->y : 0);
+    const int64_t right = (int64_t)crop->x + crop->width;
+    const int64_t bottom = (int64_t)crop->y + crop->height;
+    const size_t x2 = (right < 0 ? 0 : ((size_t)right < width ? (size_t)right : width));
+    const size_t y2 = (bottom < 0 ? 0 : ((size_t)bottom < height ? (size_t)bottom : height));
+    if (x1 >= x2 || y1 >= y2) {
+        /* Nothing is visible, but keep a valid (tiny) image. */
+        r.width = r.height = 1;
+        return r;
+    }
+
+    r.x = x1;
+    r.y = y1;
+    r.width = x2 - x1;
+    r.height = y2 - y1;
+    return r;
+}
+
+/*
+ * Makes the cropped image appear where the region was in the full image.
+ *
+ */
+static void place_region(cairo_surface_t *surface, const region_t *r) {
+    if (r->x > 0 || r->y > 0)
+        cairo_surface_set_device_offset(surface, -(double)r->x, -(double)r->y);
+}
+
+/*
+ * Returns the part of the image which is within crop, freeing the original
+ * image if it is cropped. Used for images which cairo decodes as a whole
+ * (PNG), so that only the visible part is kept around.
+ *
+ */
+cairo_surface_t *crop_image(cairo_surface_t *image, const Rect *crop) {
+    const size_t width = cairo_image_surface_get_width(image);
+    const size_t height = cairo_image_surface_get_height(image);
+    const region_t r = visible_region(crop, width, height);
+    if (r.width == width && r.height == height)
+        return image;
+
+    cairo_surface_t *cropped = cairo_image_surface_create(cairo_image_surface_get_format(image), r.width, r.height);
+    if (cairo_surface_status(cropped) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(cropped);
+        return image;
+    }
+
+    cairo_t *ctx = cairo_create(cropped);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(ctx, image, -(double)r.x, -(double)r.y);
+    cairo_paint(ctx);
+    cairo_destroy(ctx);
+    place_region(cropped, &r);
+
+    DEBUG("cropped the %zux%zu image to %zux%zu at %zu, %zu\n", width, height, r.width, r.height, r.x, r.y);
+    cairo_surface_destroy(image);
+    return cropped;
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Reads a raw image (--raw), keeping only the part which is within crop (if
+ * not NULL). Rows outside of it are not read at all.
+ *
+ */
+cairo_surface_t *read_raw_image(const char *image_path, const char *image_raw_format, const Rect *crop) {
+    cairo_surface_t *img;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#define RAW_PIXFMT_MAXLEN 6
+#define STRINGIFY1(x) #x
+#define STRINGIFY(x) STRINGIFY1(x)
+    /* Parse format as <width>x<height>:<pixfmt> */
+    char pixfmt[RAW_PIXFMT_MAXLEN + 1];
+    size_t w, h;
+    const char *fmt = "%zux%zu:%" STRINGIFY(RAW_PIXFMT_MAXLEN) "s";
+    if (sscanf(image_raw_format, fmt, &w, &h, pixfmt) != 3) {
+        fprintf(stderr, "Invalid image format: \"%s\"\n", image_raw_format);
+        return NULL;
+    }
+#undef RAW_PIXFMT_MAXLEN
+#undef STRINGIFY1
+#undef STRINGIFY
+
+    const struct raw_pixel_format *pixel_format = NULL;
+    const bool native = (strcmp(pixfmt, "native") == 0);
+    if (!native) {
+        if (strcmp(pixfmt, "rgb") == 0)
+            pixel_format = &raw_fmt_rgb;
+        else if (strcmp(pixfmt, "rgbx") == 0)
+            pixel_format = &raw_fmt_rgbx;
+        else if (strcmp(pixfmt, "xrgb") == 0)
+            pixel_format = &raw_fmt_xrgb;
+        else if (strcmp(pixfmt, "bgr") == 0)
+            pixel_format = &raw_fmt_bgr;
+        else if (strcmp(pixfmt, "bgrx") == 0)
+            pixel_format = &raw_fmt_bgrx;
+        else if (strcmp(pixfmt, "xbgr") == 0)
+            pixel_format = &raw_fmt_xbgr;
+
+        if (pixel_format == NULL) {
+            fprintf(stderr, "Unknown raw pixel format: %s\n", pixfmt);
+            return NULL;
+        }
+    }
+
+    const size_t bpp = (native ? 4 : pixel_format->bpp);
+    const size_t row_size = w * bpp;
+    const region_t r = visible_region(crop, w, h);
+    const size_t size = r.height * row_size;
+
+    int fd = open(image_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open image \"%s\": %s\n",
+                image_path, strerror(errno));
+        return NULL;
+    }
+
+    raw_file_t file;
+    if (!read_raw_file(fd, r.y * row_size, size, &file)) {
+        fprintf(stderr, "Failed to read image \"%s\": %s\n",
+                image_path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    const char *kernel = "memcpy";
+
+    /* Create image surface. Native images are copied as well instead of
+     * using the mapping, see create_surface_for_file(). */
+    img = cairo_image_surface_create(CAIRO_FORMAT_RGB24, r.width, r.height);
+    if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Could not create surface: %s\n",
+                cairo_status_to_string(cairo_surface_status(img)));
+        release_raw_file(&file);
+        return NULL;
+    }
+    cairo_surface_flush(img);
+
+    /* Use uint32_t* because cairo uses native endianness */
+    uint32_t *data = (uint32_t *)cairo_image_surface_get_data(img);
+    const int pixstride = cairo_image_surface_get_stride(img) / 4;
+
+    /* Convert the image, respecting cairo's stride, according to the pixfmt.
+     * Only complete rows are converted. */
+    const size_t rows = (file.size / row_size < r.height ? file.size / row_size : r.height);
+    const size_t count = (file.size < size ? file.size : size);
+    const uint8_t *first = file.data + r.x * bpp;
+    if (native) {
+        /* If the pixfmt is 'native', just copy each line directly into the
+         * buffer */
+        if ((size_t)pixstride == w && r.width == w) {
+            memcpy(data, file.data, count);
+        } else {
+            for (size_t y = 0; y < rows; y++)
+                memcpy(&data[y * pixstride], first + y * row_size, r.width * 4);
+        }
+    } else {
+        uint8_t mask[16];
+        build_shuffle_mask(pixel_format, mask);
+        swizzle_func_t swizzle = select_swizzle_kernel(&kernel);
+        for (size_t y = 0; y < rows; y++)
+            swizzle(&data[y * pixstride], first + y * row_size, r.width, pixel_format, mask);
+    }
+
+    cairo_surface_mark_dirty(img);
+    place_region(img, &r);
+
+    release_raw_file(&file);
+
+    if (count < size) {
+        /* Print a warning if the file contains less data than expected,
+         * but don't abort. It's useful to see how the image looks even if it's wrong. */
+        fprintf(stderr, "Warning: expected to read %zi bytes from \"%s\", read %zi\n",
+                size, image_path, count);
+    }
+
+    DEBUG("read raw image %zux%zu:%s (%zux%zu visible) in %.3f ms (%s kernel)\n",
+          w, h, pixfmt, r.width, r.height, elapsed_ms(&start), kernel);
+    return img;
+}
+
+/* The header of a file in the image cache (--cache-image). It is followed by
+ * the source path and, at data_offset, the pixels in cairo’s format and
+ * stride. */
+typedef struct {
+    char magic[8];
+    /* Identify the source file, so that changing it invalidates the entry. */
+    uint64_t source_size;
+    uint64_t source_ino;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint32_t path_length;
+    /* The image: a cairo_format_t, its size and where it is painted. */
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    int32_t offset_x;
+    int32_t offset_y;
+    uint32_t data_offset;
+} cache_header_t;
+
+static const char cache_magic[8] = "i3lock\x01";
+
+/* Each entry is a full decoded image (e.g. 33 MB at 4K), and every image path
+ * and monitor layout gets one. Only the most recently used ones are kept. */
+#define CACHE_MAX_ENTRIES 8
+
+/*
+ * Returns the path of the cache file for the given image and crop in the
+ * static buffer, or NULL if there is no cache directory. The file name only
+ * depends on the arguments, so a changed image replaces its old entry.
+ *
+ */
+static const char *cache_file_path(const char *image_path, const char *raw_format, const Rect *crop, bool create) {
+    static char path[4096];
+    char dir[4096];
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int len;
+    if (cache_home != NULL && cache_home[0] == '/')
+        len = snprintf(dir, sizeof(dir), "%s", cache_home);
+    else if (home != NULL)
+        len = snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return NULL;
+    if (len < 0 || (size_t)len >= sizeof(dir) - strlen("/i3lock"))
+        return NULL;
+    if (create)
+        (void)mkdir(dir, 0700);
+    strcat(dir, "/i3lock");
+    if (create && mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return NULL;
+
+    /* FNV-1a over everything which determines the pixels. */
+    uint64_t hash = 14695981039346656037ULL;
+#define HASH_BYTES(p, n)                            \
+    for (size_t i = 0; i < (n); i++) {              \
+        hash ^= ((const uint8_t *)(p))[i];          \
+        hash *= 1099511628211ULL;                   \
+    }
+    HASH_BYTES(image_path, strlen(image_path) + 1);
+    if (raw_format != NULL)
+        HASH_BYTES(raw_format, strlen(raw_format) + 1);
+    if (crop != NULL) {
+        const int32_t c[4] = {crop->x, crop->y, crop->width, crop->height};
+        HASH_BYTES(c, sizeof(c));
+    }
+#undef HASH_BYTES
+
+    len = snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)hash);
+    if (len < 0 || (size_t)len >= sizeof(path))
+        return NULL;
+    return path;
+}
+
+static void fill_source(cache_header_t *header, const struct stat *st) {
+    header->source_size = st->st_size;
+    header->source_ino = st->st_ino;
+    header->source_mtime_sec = st->st_mtim.tv_sec;
+    header->source_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * Returns the image from the cache, mapped into memory without decoding, or
+ * NULL if it is not cached (or the image changed since).
+ *
+ */
+cairo_surface_t *read_cached_image(const char *image_path, const char *raw_format, const Rect *crop) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct stat st;
+    const char *path = cache_file_path(image_path, raw_format, crop, false);
+    if (path == NULL || stat(image_path, &st) == -1)
+        return NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    raw_file_t file;
+    const bool read = read_raw_file(fd, 0, SIZE_MAX, &file);
+    close(fd);
+    if (!read)
+        return NULL;
+
+    cache_header_t expected, header;
+    memset(&expected, '\0', sizeof(expected));
+    fill_source(&expected, &st);
+    const size_t path_length = strlen(image_path);
+    if (file.size < sizeof(header) + path_length)
+        goto miss;
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 ||
+        header.source_size != expected.source_size ||
+        header.source_ino != expected.source_ino ||
+        header.source_mtime_sec != expected.source_mtime_sec ||
+        header.source_mtime_nsec != expected.source_mtime_nsec ||
+        header.path_length != path_length ||
+        memcmp(file.data + sizeof(header), image_path, path_length) != 0)
+        goto miss;
+    if (header.format != CAIRO_FORMAT_RGB24 && header.format != CAIRO_FORMAT_ARGB32)
+        goto miss;
+    if (header.data_offset < sizeof(header) + path_length || header.data_offset > file.size)
+        goto miss;
+
+    /* The surface only sees the pixels, but owns the entire file. */
+    raw_file_t pixels = file;
+    pixels.data += header.data_offset;
+    pixels.size -= header.data_offset;
+    cairo_surface_t *img = create_surface_for_file(&pixels, header.format, header.width, header.height);
+    if (img == NULL)
+        goto miss;
+    if (header.offset_x != 0 || header.offset_y != 0)
+        cairo_surface_set_device_offset(img, header.offset_x, header.offset_y);
+
+    /* Marks the entry as recently used, see evict_cache_entries(). */
+    (void)utimensat(AT_FDCWD, path, NULL, 0);
+
+    DEBUG("read %ux%u image from the cache (%s) in %.3f ms\n",
+          header.width, header.height, path, elapsed_ms(&start));
+    return img;
+
+miss:
+    DEBUG("cache entry %s is outdated or invalid\n", path);
+    release_raw_file(&file);
+    return NULL;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = (const uint8_t *)data + n;
+        size -= n;
+    }
+    return true;
+}
+
+typedef struct {
+    char name[32];
+    struct timespec mtime;
+} cache_entry_t;
+
+static int compare_entries(const void *a, const void *b) {
+    const struct timespec *x = &((const cache_entry_t *)a)->mtime;
+    const struct timespec *y = &((const cache_entry_t *)b)->mtime;
+    /* Most recently used first. */
+    if (x->tv_sec != y->tv_sec)
+        return (x->tv_sec < y->tv_sec) - (x->tv_sec > y->tv_sec);
+    return (x->tv_nsec < y->tv_nsec) - (x->tv_nsec > y->tv_nsec);
+}
+
+/*
+ * Deletes all but the CACHE_MAX_ENTRIES most recently used entries (by
+ * modification time, which read_cached_image() updates) from the cache
+ * directory of the given entry. Other files in it are left alone.
+ *
+ */
+static void evict_cache_entries(const char *entry_path) {
+    char dir[4096];
+    const char *slash = strrchr(entry_path, '/');
+    if (slash == NULL || (size_t)(slash - entry_path) >= sizeof(dir))
+        return;
+    memcpy(dir, entry_path, slash - entry_path);
+    dir[slash - entry_path] = '\0';
+
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    cache_entry_t *entries = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        /* Entries are named by their 64-bit hash, see cache_file_path(). */
+        if (strlen(e->d_name) != 16 || strspn(e->d_name, "0123456789abcdef") != 16)
+            continue;
+        struct stat st;
+        if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        if (count == capacity) {
+            capacity = (capacity == 0 ? 16 : capacity * 2);
+            cache_entry_t *grown = realloc(entries, capacity * sizeof(cache_entry_t));
+            if (grown == NULL)
+                break;
+            entries = grown;
+        }
+        strcpy(entries[count].name, e->d_name);
+        entries[count].mtime = st.st_mtim;
+        count++;
+    }
+
+    if (count > CACHE_MAX_ENTRIES) {
+        qsort(entries, count, sizeof(cache_entry_t), compare_entries);
+        for (size_t i = CACHE_MAX_ENTRIES; i < count; i++) {
+            DEBUG("evicting cache entry %s/%s\n", dir, entries[i].name);
+            (void)unlinkat(dirfd(d), entries[i].name, 0);
+        }
+    }
+    free(entries);
+    closedir(d);
+}
+
+/*
+ * Stores the decoded image in the cache, so that read_cached_image() can map
+ * it the next time. Errors are not fatal, the image is just decoded again.
+ *
+ */
+void write_cached_image(const char *image_path, const char *raw_format, const Rect *crop, cairo_surface_t *img) {
+    struct stat st;
+    if (cairo_surface_get_type(img) != CAIRO_SURFACE_TYPE_IMAGE || stat(image_path, &st) == -1)
+        return;
+    const cairo_format_t format = cairo_image_surface_get_format(img);
+    const int width = cairo_image_surface_get_width(img);
+    const int height = cairo_image_surface_get_height(img);
+    const int stride = cairo_image_surface_get_stride(img);
+    if ((format != CAIRO_FORMAT_RGB24 && format != CAIRO_FORMAT_ARGB32) || stride != width * 4)
+        return;
+
+    const char *path = cache_file_path(image_path, raw_format, crop, true);
+    if (path == NULL)
+        return;
+
+    cache_header_t header;
+    memset(&header, '\0', sizeof(header));
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    fill_source(&header, &st);
+    header.path_length = strlen(image_path);
+    header.format = format;
+    header.width = width;
+    header.height = height;
+    double x, y;
+    cairo_surface_get_device_offset(img, &x, &y);
+    header.offset_x = x;
+    header.offset_y = y;
+    /* Keep the pixels aligned. */
+    header.data_offset = (sizeof(header) + header.path_length + 63) & ~63;
+
+    /* Written to a temporary file first, so that a concurrent reader never
+     * sees a partial entry. */
+    char tmp[4096 + 8];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        DEBUG("could not create cache entry %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    static const uint8_t padding[64];
+    cairo_surface_flush(img);
+    const bool written =
+        write_all(fd, &header, sizeof(header)) &&
+        write_all(fd, image_path, header.path_length) &&
+        write_all(fd, padding, header.data_offset - sizeof(header) - header.path_length) &&
+        write_all(fd, cairo_image_surface_get_data(img), (size_t)stride * height);
+    if (close(fd) == -1 || !written || rename(tmp, path) == -1) {
+        DEBUG("could not write cache entry %s: %s\n", path, strerror(errno));
+        (void)unlink(tmp);
+        return;
+    }
+    DEBUG("stored %dx%d image in the cache (%s)\n", width, height, path);
+    evict_cache_entries(path);
+}
@@ -0,0 +1,11 @@
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include <cairo.h>
+
+cairo_surface_t *read_raw_image(const char *image_path, const char *image_raw_format, const Rect *crop);
+cairo_surface_t *crop_image(cairo_surface_t *image, const Rect *crop);
+cairo_surface_t *read_cached_image(const char *image_path, const char *raw_format, const Rect *crop);
+void write_cached_image(const char *image_path, const char *raw_format, const Rect *crop, cairo_surface_t *img);
+
+#endif
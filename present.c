@@ -0,0 +1,180 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * present.c: displays frames using the X Present extension: frames are
+ *            rendered into a back buffer and flipped (or copied) to the
+ *            window in sync with the vertical blank, so the server never
+ *            scans out a half-drawn frame.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <xcb/xcb.h>
+#include <xcb/present.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "unlock_indicator.h"
+#include "present.h"
+
+extern bool debug_mode;
+
+static bool present_active = false;
+static uint8_t present_opcode;
+static xcb_window_t present_window;
+static uint32_t present_serial = 0;
+
+/* Time of the last key press which was not yet part of a presented frame, in
+ * µs of CLOCK_MONOTONIC (the clock the X server uses for UST timestamps). */
+static uint64_t pending_input_us = 0;
+
+/* Submission times of the frames which are in flight, indexed by serial. */
+#define FRAMES_IN_FLIGHT 8
+static struct {
+    uint32_t serial;
+    uint64_t submit_us;
+    uint64_t input_us;
+} in_flight[FRAMES_IN_FLIGHT];
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Checks whether the Present extension is available and selects its events on
+ * the given window. Returns false if frames need to be displayed by updating
+ * the window background pixmap instead.
+ *
+ */
+bool present_init(xcb_connection_t *conn, xcb_window_t window) {
+    const xcb_query_extension_reply_t *extreply;
+
+    extreply = xcb_get_extension_data(conn, &xcb_present_id);
+    if (extreply == NULL || !extreply->present) {
+        DEBUG("Present is not available, falling back to updating the background pixmap.\n");
+        return false;
+    }
+
+    xcb_generic_error_t *err;
+    xcb_present_query_version_reply_t *version =
+        xcb_present_query_version_reply(
+            conn, xcb_present_query_version(conn, XCB_PRESENT_MAJOR_VERSION, XCB_PRESENT_MINOR_VERSION), &err);
+    if (version == NULL) {
+        DEBUG("Could not query Present version: X11 error code %d\n", err->error_code);
+        free(err);
+        return false;
+    }
+    DEBUG("Using Present %d.%d\n", version->major_version, version->minor_version);
+    free(version);
+
+    present_opcode = extreply->major_opcode;
+    present_window = window;
+    xcb_present_select_input(conn, xcb_generate_id(conn), window,
+                             XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY |
+                                 XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+    present_active = true;
+    return true;
+}
+
+/*
+ * Returns whether frames are displayed using Present.
+ *
+ */
+bool present_enabled(void) {
+    return present_active;
+}
+
+/*
+ * Remembers the time of a key press, so that the latency until the resulting
+ * frame is on screen can be reported.
+ *
+ */
+void present_mark_input(void) {
+    if (present_active && pending_input_us == 0)
+        pending_input_us = now_us();
+}
+
+/*
+ * Displays the given pixmap on the next vertical blank.
+ *
+ */
+void present_frame(xcb_pixmap_t pixmap) {
+    present_serial++;
+    in_flight[present_serial % FRAMES_IN_FLIGHT].serial = present_serial;
+    in_flight[present_serial % FRAMES_IN_FLIGHT].submit_us = now_us();
+    in_flight[present_serial % FRAMES_IN_FLIGHT].input_us = pending_input_us;
+    pending_input_us = 0;
+
+    xcb_present_pixmap(conn, present_window, pixmap, present_serial,
+                       XCB_NONE, /* valid: the whole pixmap */
+                       XCB_NONE, /* update: the whole pixmap */
+                       0, 0,
+                       XCB_NONE, /* target_crtc: let the server pick one */
+                       XCB_NONE, /* wait_fence */
+                       XCB_NONE, /* idle_fence */
+                       XCB_PRESENT_OPTION_NONE,
+                       0, 0, 0, /* next vertical blank */
+                       0, NULL);
+}
+
+static const char *complete_mode_name(uint8_t mode) {
+    switch (mode) {
+        case XCB_PRESENT_COMPLETE_MODE_COPY:
+            return "copy";
+        case XCB_PRESENT_COMPLETE_MODE_FLIP:
+            return "flip";
+        case XCB_PRESENT_COMPLETE_MODE_SKIP:
+            return "skip";
+        default:
+            return "unknown";
+    }
+}
+
+/*
+ * Handles Present events. Returns false if the event is not a Present event.
+ *
+ */
+bool present_handle_event(xcb_generic_event_t *event) {
+    if (!present_active || (event->response_type & 0x7F) != XCB_GE_GENERIC)
+        return false;
+
+    xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)event;
+    if (ge->extension != present_opcode)
+        return false;
+
+    switch (ge->event_type) {
+        case XCB_PRESENT_COMPLETE_NOTIFY: {
+            xcb_present_complete_notify_event_t *complete = (xcb_present_complete_notify_event_t *)event;
+            if (complete->kind != XCB_PRESENT_COMPLETE_KIND_PIXMAP)
+                break;
+
+            if (debug_mode && in_flight[complete->serial % FRAMES_IN_FLIGHT].serial == complete->serial) {
+                const uint64_t submit_us = in_flight[complete->serial % FRAMES_IN_FLIGHT].submit_us;
+                const uint64_t input_us = in_flight[complete->serial % FRAMES_IN_FLIGHT].input_us;
+                DEBUG("frame %u presented (%s) at msc %llu, ust %llu: %.3f ms after submission",
+                      complete->serial, complete_mode_name(complete->mode),
+                      (unsigned long long)complete->msc, (unsigned long long)complete->ust,
+                      ((double)complete->ust - submit_us) / 1000.0);
+                if (input_us != 0)
+                    fprintf(stderr, ", %.3f ms after key press", ((double)complete->ust - input_us) / 1000.0);
+                fprintf(stderr, "\n");
+            }
+            break;
+        }
+
+        case XCB_PRESENT_IDLE_NOTIFY: {
+            xcb_present_idle_notify_event_t *idle = (xcb_present_idle_notify_event_t *)event;
+            frame_buffer_idle(idle->pixmap);
+            break;
+        }
+    }
+
+    return true;
+}
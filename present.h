@@ -0,0 +1,13 @@
+#ifndef _PRESENT_H
+#define _PRESENT_H
+
+#include <stdbool.h>
+#include <xcb/xcb.h>
+
+bool present_init(xcb_connection_t *conn, xcb_window_t window);
+bool present_enabled(void);
+void present_mark_input(void);
+void present_frame(xcb_pixmap_t pixmap);
+bool present_handle_event(xcb_generic_event_t *event);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * profile.c: records when each startup phase was done, for --profile-startup,
+ *            and reports the memory usage for --debug.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "i3lock.h"
+#include "profile.h"
+
+extern bool debug_mode;
+
+/* Whether the timings are printed (--profile-startup). They are recorded
+ * regardless, which is cheap and allows marking phases before the command
+ * line was parsed. */
+bool profile_startup = false;
+
+#define MAX_PHASES 32
+
+static struct {
+    const char *phase;
+    struct timespec when;
+} phases[MAX_PHASES];
+static int num_phases = 0;
+static bool reported = false;
+
+/*
+ * Records that the given phase is done. The first mark is the start of the
+ * timeline.
+ *
+ */
+void profile_mark(const char *phase) {
+    if (num_phases == MAX_PHASES)
+        return;
+    phases[num_phases].phase = phase;
+    clock_gettime(CLOCK_MONOTONIC, &phases[num_phases].when);
+    num_phases++;
+}
+
+static double ms_between(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Prints the time each phase took (and when it was done, relative to the
+ * first mark) to stderr, once.
+ *
+ */
+void profile_report(void) {
+    if (!profile_startup || reported || num_phases == 0)
+        return;
+    reported = true;
+
+    fprintf(stderr, "[i3lock] startup profile:\n");
+    for (int i = 1; i < num_phases; i++) {
+        fprintf(stderr, "[i3lock] %9.3f ms %9.3f ms  %s\n",
+                ms_between(&phases[0].when, &phases[i].when),
+                ms_between(&phases[i - 1].when, &phases[i].when),
+                phases[i].phase);
+    }
+}
+
+/*
+ * Logs the resident set size right now and its peak so far (Linux only), e.g.
+ * to compare the memory usage with and without --low-memory.
+ *
+ */
+void profile_memory(const char *when) {
+    if (!debug_mode)
+        return;
+
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL)
+        return;
+
+    char line[128];
+    unsigned long rss = 0, hwm = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "VmRSS:", strlen("VmRSS:")) == 0)
+            sscanf(line, "VmRSS: %lu", &rss);
+        else if (strncmp(line, "VmHWM:", strlen("VmHWM:")) == 0)
+            sscanf(line, "VmHWM: %lu", &hwm);
+    }
+    fclose(f);
+
+    DEBUG("memory usage %s: %lu kB resident, %lu kB peak\n", when, rss, hwm);
+}
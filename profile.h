@@ -0,0 +1,12 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdbool.h>
+
+extern bool profile_startup;
+
+void profile_mark(const char *phase);
+void profile_report(void);
+void profile_memory(const char *when);
+
+#endif
@@ -17,6 +17,7 @@
 #include "i3lock.h"
 #include "xcb.h"
 #include "randr.h"
+#include "trace.h"
 
 /* Number of Xinerama screens which are currently present. */
 int xr_screens = 0;
@@ -31,7 +32,18 @@ extern bool debug_mode;
 
 void _xinerama_init(void);
 
-void randr_init(int *event_base, xcb_window_t root) {
+static bool randr_version_pending = false;
+static xcb_randr_query_version_cookie_t randr_version_cookie;
+static xcb_window_t randr_root;
+/* Only set once RandR events are selected. */
+static int randr_event_base = -1;
+
+/*
+ * Sends the RandR version query. Its reply is collected by the first
+ * randr_query(), so that the round trip overlaps with other startup work.
+ *
+ */
+void randr_init(xcb_window_t root) {
     const xcb_query_extension_reply_t *extreply;
 
     extreply = xcb_get_extension_data(conn, &xcb_randr_id);
@@ -41,12 +53,20 @@ void randr_init(int *event_base, xcb_window_t root) {
         return;
     }
 
+    randr_version_cookie = xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION);
+    randr_version_pending = true;
+    randr_root = root;
+}
+
+static void _randr_finish_init(void) {
+    randr_version_pending = false;
+
     xcb_generic_error_t *err;
     xcb_randr_query_version_reply_t *randr_version =
-        xcb_randr_query_version_reply(
-            conn, xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION), &err);
+        xcb_randr_query_version_reply(conn, randr_version_cookie, &err);
     if (err != NULL) {
         DEBUG("Could not query RandR version: X11 error code %d\n", err->error_code);
+        free(err);
         _xinerama_init();
         return;
     }
@@ -58,10 +78,8 @@ void randr_init(int *event_base, xcb_window_t root) {
 
     free(randr_version);
 
-    if (event_base != NULL)
-        *event_base = extreply->first_event;
-
-    xcb_randr_select_input(conn, root,
+    randr_event_base = xcb_get_extension_data(conn, &xcb_randr_id)->first_event;
+    xcb_randr_select_input(conn, randr_root,
                            XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
                                XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE |
                                XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
@@ -154,15 +172,126 @@ static bool _randr_query_monitors_15(xcb_window_t root) {
 }
 
 /*
- * randr_query_outputs_14 uses RandR ≤ 1.4 to update outputs.
+ * The RandR ≤ 1.4 view of the outputs. It is filled by one full query and then
+ * kept up to date from RRNotify events, so that a change (e.g. a docking
+ * station being connected) only costs requests for the CRTCs which changed.
  *
  */
-static bool _randr_query_outputs_14(xcb_window_t root) {
-    if (!has_randr) {
-        return false;
+typedef struct {
+    xcb_randr_crtc_t id;
+    /* The geometry needs to be re-read from the server. */
+    bool stale;
+    /* Zero-sized while the CRTC is disabled. */
+    Rect rect;
+} crtc_state_t;
+
+typedef struct {
+    xcb_randr_output_t id;
+    xcb_randr_crtc_t crtc;
+} output_state_t;
+
+static struct {
+    /* Without a full query first, there is nothing to update. */
+    bool valid;
+    xcb_timestamp_t config_timestamp;
+
+    crtc_state_t *crtcs;
+    int num_crtcs;
+
+    output_state_t *outputs;
+    int num_outputs;
+} model;
+
+/* Set whenever the monitor layout may have changed, see randr_update(). */
+static bool outputs_dirty = false;
+
+static crtc_state_t *find_crtc(xcb_randr_crtc_t id) {
+    for (int i = 0; i < model.num_crtcs; i++) {
+        if (model.crtcs[i].id == id)
+            return &model.crtcs[i];
+    }
+    return NULL;
+}
+
+/*
+ * Returns the model’s entry for the given CRTC, creating a stale one if it is
+ * unknown. Returns NULL when out of memory.
+ *
+ */
+static crtc_state_t *model_crtc(xcb_randr_crtc_t id) {
+    crtc_state_t *known = find_crtc(id);
+    if (known != NULL)
+        return known;
+
+    crtc_state_t *crtcs = realloc(model.crtcs, (model.num_crtcs + 1) * sizeof(crtc_state_t));
+    if (crtcs == NULL)
+        return NULL;
+    model.crtcs = crtcs;
+    model.crtcs[model.num_crtcs] = (crtc_state_t){.id = id, .stale = true};
+    return &model.crtcs[model.num_crtcs++];
+}
+
+/*
+ * Returns the model’s entry for the given output, creating one if it is
+ * unknown. Returns NULL when out of memory.
+ *
+ */
+static output_state_t *model_output(xcb_randr_output_t id) {
+    for (int i = 0; i < model.num_outputs; i++) {
+        if (model.outputs[i].id == id)
+            return &model.outputs[i];
+    }
+
+    output_state_t *outputs = realloc(model.outputs, (model.num_outputs + 1) * sizeof(output_state_t));
+    if (outputs == NULL)
+        return NULL;
+    model.outputs = outputs;
+    model.outputs[model.num_outputs] = (output_state_t){.id = id, .crtc = XCB_NONE};
+    return &model.outputs[model.num_outputs++];
+}
+
+/*
+ * Re-reads the geometry of all stale CRTCs. All requests are sent before the
+ * first reply is waited for, so this takes a single round trip.
+ *
+ */
+static void _randr_refresh_crtcs(void) {
+    if (model.num_crtcs == 0)
+        return;
+
+    xcb_randr_get_crtc_info_cookie_t ccookie[model.num_crtcs];
+    for (int i = 0; i < model.num_crtcs; i++) {
+        if (model.crtcs[i].stale)
+            ccookie[i] = xcb_randr_get_crtc_info(conn, model.crtcs[i].id, model.config_timestamp);
     }
-    DEBUG("Querying outputs using RandR ≤ 1.4\n");
 
+    for (int i = 0; i < model.num_crtcs; i++) {
+        crtc_state_t *state = &model.crtcs[i];
+        if (!state->stale)
+            continue;
+
+        state->stale = false;
+        xcb_randr_get_crtc_info_reply_t *crtc = xcb_randr_get_crtc_info_reply(conn, ccookie[i], NULL);
+        if (crtc == NULL) {
+            DEBUG("Could not get CRTC (0x%08x)\n", state->id);
+            state->rect = (Rect){0, 0, 0, 0};
+            continue;
+        }
+
+        state->rect.x = crtc->x;
+        state->rect.y = crtc->y;
+        state->rect.width = crtc->width;
+        state->rect.height = crtc->height;
+        free(crtc);
+    }
+}
+
+/*
+ * Replaces the model with the server’s current configuration. The output and
+ * CRTC information is requested all at once.
+ *
+ */
+static bool _randr_load_model(xcb_window_t root) {
     /* Get screen resources (primary output, crtcs, outputs, modes) */
     xcb_randr_get_screen_resources_current_cookie_t rcookie;
     rcookie = xcb_randr_get_screen_resources_current(conn, root);
@@ -178,69 +307,145 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
      * requests (if the configuration changes between our different calls) */
     const xcb_timestamp_t cts = res->config_timestamp;
 
-    const int len = xcb_randr_get_screen_resources_current_outputs_length(res);
-
     /* an output is VGA-1, LVDS-1, etc. (usually physical video outputs) */
+    const int num_outputs = xcb_randr_get_screen_resources_current_outputs_length(res);
     xcb_randr_output_t *randr_outputs = xcb_randr_get_screen_resources_current_outputs(res);
 
-    /* Request information for each output */
-    xcb_randr_get_output_info_cookie_t ocookie[len];
-    for (int i = 0; i < len; i++) {
-        ocookie[i] = xcb_randr_get_output_info(conn, randr_outputs[i], cts);
-    }
-    Rect *resolutions = malloc(len * sizeof(Rect));
+    const int num_crtcs = xcb_randr_get_screen_resources_current_crtcs_length(res);
+    xcb_randr_crtc_t *randr_crtcs = xcb_randr_get_screen_resources_current_crtcs(res);
+
+    output_state_t *outputs = malloc(num_outputs * sizeof(output_state_t));
+    crtc_state_t *crtcs = malloc(num_crtcs * sizeof(crtc_state_t));
     /* No memory? Just keep on using the old information. */
-    if (!resolutions) {
+    if (!outputs || !crtcs) {
+        free(outputs);
+        free(crtcs);
         free(res);
-        return true;
+        return false;
     }
 
-    /* Loop through all outputs available for this X11 screen */
-    int screen = 0;
+    /* Request information for each output */
+    xcb_randr_get_output_info_cookie_t ocookie[num_outputs];
+    for (int i = 0; i < num_outputs; i++) {
+        ocookie[i] = xcb_randr_get_output_info(conn, randr_outputs[i], cts);
+    }
+
+    free(model.outputs);
+    free(model.crtcs);
+    model.outputs = outputs;
+    model.num_outputs = num_outputs;
+    model.crtcs = crtcs;
+    model.num_crtcs = num_crtcs;
+    model.config_timestamp = cts;
+    model.valid = true;
+
+    /* The CRTC requests go out before the first output reply is read. */
+    for (int i = 0; i < num_crtcs; i++) {
+        crtcs[i] = (crtc_state_t){.id = randr_crtcs[i], .stale = true};
+    }
+    _randr_refresh_crtcs();
 
-    for (int i = 0; i < len; i++) {
+    for (int i = 0; i < num_outputs; i++) {
         xcb_randr_get_output_info_reply_t *output;
 
+        outputs[i] = (output_state_t){.id = randr_outputs[i], .crtc = XCB_NONE};
         if ((output = xcb_randr_get_output_info_reply(conn, ocookie[i], NULL)) == NULL) {
             continue;
         }
+        outputs[i].crtc = output->crtc;
+        free(output);
+    }
 
+    free(res);
+    return true;
+}
+
+/*
+ * randr_query_outputs_14 uses RandR ≤ 1.4 to update outputs.
+ *
+ */
+static bool _randr_query_outputs_14(xcb_window_t root) {
+    if (!has_randr) {
+        return false;
+    }
+
+    if (!model.valid) {
+        DEBUG("Querying outputs using RandR ≤ 1.4\n");
+        if (!_randr_load_model(root))
+            return model.valid;
+    } else {
+        _randr_refresh_crtcs();
+    }
+
+    Rect *resolutions = malloc(model.num_outputs * sizeof(Rect));
+    /* No memory? Just keep on using the old information. */
+    if (!resolutions) {
+        return true;
+    }
+
+    /* Loop through all outputs available for this X11 screen */
+    int screen = 0;
+
+    for (int i = 0; i < model.num_outputs; i++) {
+        const output_state_t *output = &model.outputs[i];
         if (output->crtc == XCB_NONE) {
-            free(output);
             continue;
         }
 
-        xcb_randr_get_crtc_info_cookie_t icookie;
-        xcb_randr_get_crtc_info_reply_t *crtc;
-        icookie = xcb_randr_get_crtc_info(conn, output->crtc, cts);
-        if ((crtc = xcb_randr_get_crtc_info_reply(conn, icookie, NULL)) == NULL) {
-            DEBUG("Skipping output: could not get CRTC (0x%08x)\n", output->crtc);
-            free(output);
+        const crtc_state_t *crtc = find_crtc(output->crtc);
+        if (crtc == NULL || crtc->stale || crtc->rect.width == 0) {
+            DEBUG("Skipping output: CRTC 0x%08x is unknown or disabled\n", output->crtc);
             continue;
         }
 
-        resolutions[screen].x = crtc->x;
-        resolutions[screen].y = crtc->y;
-        resolutions[screen].width = crtc->width;
-        resolutions[screen].height = crtc->height;
+        resolutions[screen] = crtc->rect;
 
         DEBUG("found RandR output: %d x %d at %d x %d\n",
-              crtc->width, crtc->height,
-              crtc->x, crtc->y);
+              crtc->rect.width, crtc->rect.height,
+              crtc->rect.x, crtc->rect.y);
 
         screen++;
-
-        free(crtc);
-
-        free(output);
     }
     free(xr_resolutions);
     xr_resolutions = resolutions;
     xr_screens = screen;
-    free(res);
     return true;
 }
 
+/*
+ * Updates the model from an RRNotify event. The event’s geometry does not
+ * account for transformations like scaling, so changed CRTCs are marked
+ * stale and re-read by the next randr_update() instead.
+ *
+ */
+static void _randr_handle_notify(xcb_randr_notify_event_t *event) {
+    switch (event->subCode) {
+        case XCB_RANDR_NOTIFY_CRTC_CHANGE: {
+            crtc_state_t *crtc = model_crtc(event->u.cc.crtc);
+            if (crtc == NULL)
+                model.valid = false;
+            else
+                crtc->stale = true;
+            outputs_dirty = true;
+            break;
+        }
+        case XCB_RANDR_NOTIFY_OUTPUT_CHANGE: {
+            output_state_t *output = model_output(event->u.oc.output);
+            if (output == NULL) {
+                model.valid = false;
+            } else {
+                output->crtc = event->u.oc.crtc;
+                /* Also the first time the model hears of this CRTC. */
+                if (output->crtc != XCB_NONE && model_crtc(output->crtc) == NULL)
+                    model.valid = false;
+            }
+            model.config_timestamp = event->u.oc.config_timestamp;
+            outputs_dirty = true;
+            break;
+        }
+    }
+}
+
 void _xinerama_query_screens(void) {
     if (!xinerama_active) {
         return;
@@ -284,14 +489,65 @@ void _xinerama_query_screens(void) {
     free(reply);
 }
 
-void randr_query(xcb_window_t root) {
-    if (_randr_query_monitors_15(root)) {
-        return;
+/*
+ * Handles RandR events: the monitor layout is updated by the next
+ * randr_update() call, so that a burst of events (e.g. from a docking station)
+ * is handled at once. Returns true if the event was a RandR event.
+ *
+ */
+bool randr_handle_event(xcb_generic_event_t *event) {
+    if (randr_event_base < 0)
+        return false;
+
+    const int type = (event->response_type & 0x7F);
+    if (type == randr_event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+        outputs_dirty = true;
+        return true;
+    }
+    if (type == randr_event_base + XCB_RANDR_NOTIFY) {
+        _randr_handle_notify((xcb_randr_notify_event_t *)event);
+        return true;
     }
+    return false;
+}
 
-    if (_randr_query_outputs_14(root)) {
-        return;
+/*
+ * Marks the monitor layout as changed, e.g. when the root window was resized.
+ *
+ */
+void randr_invalidate(void) {
+    outputs_dirty = true;
+}
+
+/*
+ * Updates xr_resolutions if the monitor layout might have changed since the
+ * last call. Returns true if it was updated.
+ *
+ */
+bool randr_update(xcb_window_t root) {
+    if (!outputs_dirty && !randr_version_pending)
+        return false;
+
+    TRACE_BEGIN(start);
+    if (randr_version_pending) {
+        _randr_finish_init();
     }
+    outputs_dirty = false;
 
-    _xinerama_query_screens();
+    if (!_randr_query_monitors_15(root) &&
+        !_randr_query_outputs_14(root)) {
+        _xinerama_query_screens();
+    }
+    TRACE_END_ARG(start, "randr_query", "screens", xr_screens);
+    return true;
+}
+
+/*
+ * Queries the outputs from scratch.
+ *
+ */
+void randr_query(xcb_window_t root) {
+    model.valid = false;
+    outputs_dirty = true;
+    randr_update(root);
 }
@@ -11,7 +11,10 @@ typedef struct Rect {
 extern int xr_screens;
 extern Rect *xr_resolutions;
 
-void randr_init(int *event_base, xcb_window_t root);
+void randr_init(xcb_window_t root);
 void randr_query(xcb_window_t root);
+bool randr_handle_event(xcb_generic_event_t *event);
+void randr_invalidate(void);
+bool randr_update(xcb_window_t root);
 
 #endif
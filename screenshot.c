@@ -0,0 +1,501 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * screenshot.c: captures the screen (--screenshot) and blurs (--blur) or
+ *               pixelates (--pixelate) it, so that it can be displayed
+ *               instead of an image without going through an image file.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <xcb/xcb.h>
+#include <cairo.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "screenshot.h"
+
+extern bool debug_mode;
+
+/* The number of rows which are requested at once without MIT-SHM. */
+#define GET_IMAGE_ROWS 128
+
+/* The blur is three box blurs in a row, which is close to a Gaussian blur. */
+#define BOX_PASSES 3
+
+/* At most this many threads filter the image. */
+#define MAX_THREADS 16
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Reads the root window without MIT-SHM. The rows are requested in strips, all
+ * requests are sent before the first reply is read.
+ *
+ */
+static bool get_root_image(uint8_t *data, int stride, uint16_t width, uint16_t height) {
+    const int strips = (height + GET_IMAGE_ROWS - 1) / GET_IMAGE_ROWS;
+    xcb_get_image_cookie_t *cookies = calloc(strips, sizeof(xcb_get_image_cookie_t));
+    if (cookies == NULL)
+        return false;
+
+    for (int i = 0; i < strips; i++) {
+        const uint16_t rows = (height - i * GET_IMAGE_ROWS < GET_IMAGE_ROWS ? height - i * GET_IMAGE_ROWS : GET_IMAGE_ROWS);
+        cookies[i] = xcb_get_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, screen->root,
+                                   0, i * GET_IMAGE_ROWS, width, rows, ~0);
+    }
+
+    bool ok = true;
+    for (int i = 0; i < strips; i++) {
+        xcb_get_image_reply_t *reply = xcb_get_image_reply(conn, cookies[i], NULL);
+        if (reply == NULL) {
+            ok = false;
+            continue;
+        }
+        const uint16_t rows = (height - i * GET_IMAGE_ROWS < GET_IMAGE_ROWS ? height - i * GET_IMAGE_ROWS : GET_IMAGE_ROWS);
+        if (ok && xcb_get_image_data_length(reply) >= (int)rows * width * 4) {
+            const uint8_t *src = xcb_get_image_data(reply);
+            for (int y = 0; y < rows; y++)
+                memcpy(data + (size_t)(i * GET_IMAGE_ROWS + y) * stride, src + (size_t)y * width * 4, (size_t)width * 4);
+        } else {
+            ok = false;
+        }
+        free(reply);
+    }
+    free(cookies);
+    return ok;
+}
+
+/*
+ * Captures the contents of the root window, i.e. what is currently displayed,
+ * into a new image surface. Must be called before the lock window is mapped.
+ * Returns NULL if the screen cannot be captured.
+ *
+ */
+cairo_surface_t *take_screenshot(uint32_t *resolution) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Images are transferred as-is, in cairo’s format. */
+    if (!root_format_is_rgb24(conn, screen)) {
+        fprintf(stderr, "[i3lock] Cannot capture the screen: unsupported pixel format\n");
+        return NULL;
+    }
+
+    const uint16_t width = resolution[0];
+    const uint16_t height = resolution[1];
+    cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(image);
+        return NULL;
+    }
+    cairo_surface_flush(image);
+    uint8_t *data = cairo_image_surface_get_data(image);
+    const int stride = cairo_image_surface_get_stride(image);
+
+    const char *method = "MIT-SHM";
+    shm_image_t *shm = shm_image_get(conn, screen, screen->root, width, height);
+    if (shm != NULL) {
+        for (int y = 0; y < height; y++)
+            memcpy(data + (size_t)y * stride, shm->data + (size_t)y * shm->stride, (size_t)width * 4);
+        shm_image_destroy(conn, shm);
+    } else {
+        method = "GetImage";
+        if (!get_root_image(data, stride, width, height)) {
+            fprintf(stderr, "[i3lock] Cannot capture the screen\n");
+            cairo_surface_destroy(image);
+            return NULL;
+        }
+    }
+    cairo_surface_mark_dirty(image);
+
+    DEBUG("captured %d x %d px screen via %s in %.3f ms\n", width, height, method, elapsed_ms(&start));
+    return image;
+}
+
+/*******************************************************************************
+ * Box blur kernels.
+ *
+ * A box blur of radius r sets each pixel to the average of the 2r + 1 pixels
+ * around it (the edge pixels are repeated). It is computed with a running sum
+ * per channel, so its cost does not depend on the radius. The horizontal pass
+ * handles one row at a time, the vertical pass a band of columns, going down
+ * one row at a time.
+ ******************************************************************************/
+
+typedef struct {
+    /* Blurs one row of width pixels. */
+    void (*row)(uint32_t *dest, const uint32_t *src, int width, int radius);
+    /* Adds the channels of add (and subtracts the ones of sub, if not NULL)
+     * to the running sums, four per pixel. */
+    void (*accumulate)(uint32_t *sums, const uint32_t *add, const uint32_t *sub, int width);
+    /* Stores the averages of the running sums. */
+    void (*emit)(uint32_t *dest, const uint32_t *sums, int width, int radius);
+} blur_kernel_t;
+
+static int clamp_index(int i, int n) {
+    return (i < 0 ? 0 : (i >= n ? n - 1 : i));
+}
+
+static uint32_t average_scalar(const uint32_t *sum, float scale) {
+    uint32_t px = 0;
+    for (int c = 0; c < 4; c++)
+        px |= (uint32_t)lrintf(sum[c] * scale) << (c * 8);
+    return px;
+}
+
+static void add_pixel_scalar(uint32_t *sum, uint32_t px, int factor) {
+    for (int c = 0; c < 4; c++)
+        sum[c] += factor * ((px >> (c * 8)) & 0xff);
+}
+
+static void blur_row_scalar(uint32_t *dest, const uint32_t *src, int width, int radius) {
+    const float scale = 1.0f / (2 * radius + 1);
+    uint32_t sum[4] = {0, 0, 0, 0};
+    add_pixel_scalar(sum, src[0], radius + 1);
+    for (int i = 1; i <= radius; i++)
+        add_pixel_scalar(sum, src[clamp_index(i, width)], 1);
+
+    for (int x = 0; x < width; x++) {
+        dest[x] = average_scalar(sum, scale);
+        add_pixel_scalar(sum, src[clamp_index(x + radius + 1, width)], 1);
+        add_pixel_scalar(sum, src[clamp_index(x - radius, width)], -1);
+    }
+}
+
+static void accumulate_scalar(uint32_t *sums, const uint32_t *add, const uint32_t *sub, int width) {
+    for (int x = 0; x < width; x++) {
+        add_pixel_scalar(sums + x * 4, add[x], 1);
+        if (sub != NULL)
+            add_pixel_scalar(sums + x * 4, sub[x], -1);
+    }
+}
+
+static void emit_scalar(uint32_t *dest, const uint32_t *sums, int width, int radius) {
+    const float scale = 1.0f / (2 * radius + 1);
+    for (int x = 0; x < width; x++)
+        dest[x] = average_scalar(sums + x * 4, scale);
+}
+
+static const blur_kernel_t blur_kernel_scalar = {blur_row_scalar, accumulate_scalar, emit_scalar};
+
+#if HAVE_X86_SIMD
+/*
+ * The SSE2 kernels keep the four channels of a pixel in the four 32 bit lanes
+ * of a register.
+ *
+ */
+__attribute__((target("sse2"))) static inline __m128i unpack_sse2(uint32_t px) {
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(px), zero), zero);
+}
+
+__attribute__((target("sse2"))) static inline uint32_t pack_sse2(__m128i sum, __m128 scale) {
+    const __m128i avg = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+    const __m128i words = _mm_packs_epi32(avg, avg);
+    return _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+}
+
+__attribute__((target("sse2"))) static void blur_row_sse2(uint32_t *dest, const uint32_t *src, int width, int radius) {
+    const __m128 scale = _mm_set1_ps(1.0f / (2 * radius + 1));
+    /* The upper 16 bits of each lane are 0, so this multiplies each lane. */
+    __m128i sum = _mm_madd_epi16(unpack_sse2(src[0]), _mm_set1_epi32(radius + 1));
+    for (int i = 1; i <= radius; i++)
+        sum = _mm_add_epi32(sum, unpack_sse2(src[clamp_index(i, width)]));
+
+    /* Inside of the row, no index needs to be clamped. */
+    int x = 0;
+    for (; x < width && x - radius < 0; x++) {
+        dest[x] = pack_sse2(sum, scale);
+        sum = _mm_add_epi32(sum, unpack_sse2(src[clamp_index(x + radius + 1, width)]));
+        sum = _mm_sub_epi32(sum, unpack_sse2(src[0]));
+    }
+    for (; x + radius + 1 < width; x++) {
+        dest[x] = pack_sse2(sum, scale);
+        sum = _mm_add_epi32(sum, unpack_sse2(src[x + radius + 1]));
+        sum = _mm_sub_epi32(sum, unpack_sse2(src[x - radius]));
+    }
+    for (; x < width; x++) {
+        dest[x] = pack_sse2(sum, scale);
+        sum = _mm_add_epi32(sum, unpack_sse2(src[width - 1]));
+        sum = _mm_sub_epi32(sum, unpack_sse2(src[clamp_index(x - radius, width)]));
+    }
+}
+
+__attribute__((target("sse2"))) static void accumulate_sse2(uint32_t *sums, const uint32_t *add, const uint32_t *sub, int width) {
+    for (int x = 0; x < width; x++) {
+        __m128i sum = _mm_loadu_si128((const __m128i *)(sums + x * 4));
+        sum = _mm_add_epi32(sum, unpack_sse2(add[x]));
+        if (sub != NULL)
+            sum = _mm_sub_epi32(sum, unpack_sse2(sub[x]));
+        _mm_storeu_si128((__m128i *)(sums + x * 4), sum);
+    }
+}
+
+__attribute__((target("sse2"))) static void emit_sse2(uint32_t *dest, const uint32_t *sums, int width, int radius) {
+    const __m128 scale = _mm_set1_ps(1.0f / (2 * radius + 1));
+    for (int x = 0; x < width; x++)
+        dest[x] = pack_sse2(_mm_loadu_si128((const __m128i *)(sums + x * 4)), scale);
+}
+
+static const blur_kernel_t blur_kernel_sse2 = {blur_row_sse2, accumulate_sse2, emit_sse2};
+#endif
+
+/*
+ * Picks the fastest blur kernel supported by the CPU.
+ *
+ */
+static const blur_kernel_t *select_blur_kernel(const char **name) {
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return &blur_kernel_sse2;
+    }
+#endif
+    *name = "scalar";
+    return &blur_kernel_scalar;
+}
+
+/*******************************************************************************
+ * Splitting the work across threads.
+ ******************************************************************************/
+
+typedef struct band band_t;
+typedef void (*band_func_t)(band_t *band);
+
+/* The part of the image one thread works on: rows or columns [start, end). */
+struct band {
+    band_func_t func;
+    uint32_t *data;
+    /* Scratch space of the image’s size. */
+    uint32_t *tmp;
+    int width, height;
+    /* In pixels. */
+    int stride;
+    int start, end;
+    /* The blur radius or the pixel size. */
+    int param;
+    const blur_kernel_t *kernel;
+};
+
+static void *band_thread_main(void *arg) {
+    band_t *band = arg;
+    band->func(band);
+    return NULL;
+}
+
+/*
+ * Returns how many threads to use for n rows or columns.
+ *
+ */
+static int thread_count(int n) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+    if (cpus > MAX_THREADS)
+        cpus = MAX_THREADS;
+    /* Tiny bands are not worth a thread. */
+    if (cpus > n / 64 + 1)
+        cpus = n / 64 + 1;
+    return cpus;
+}
+
+/*
+ * Splits n rows or columns into bands (multiples of align, except for the
+ * last one) and calls the band’s function for each of them on its own
+ * thread. Returns the number of threads which ran, once all bands are done.
+ *
+ */
+static int run_bands(const band_t *tmpl, int n, int align) {
+    const int count = thread_count(n);
+    band_t bands[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    bool started[MAX_THREADS];
+
+    int size = (n + count - 1) / count;
+    size = (size + align - 1) / align * align;
+    for (int i = 0; i < count; i++) {
+        bands[i] = *tmpl;
+        bands[i].start = (i * size < n ? i * size : n);
+        bands[i].end = ((i + 1) * size < n ? (i + 1) * size : n);
+    }
+
+    /* The first band is handled by the calling thread. */
+    int threads_run = 1;
+    for (int i = 1; i < count; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, band_thread_main, &bands[i]) == 0);
+        if (started[i])
+            threads_run++;
+        else
+            bands[i].func(&bands[i]);
+    }
+    bands[0].func(&bands[0]);
+    for (int i = 1; i < count; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+    return threads_run;
+}
+
+/*
+ * Blurs the band’s rows horizontally, BOX_PASSES times. Only one row at a
+ * time is needed as scratch space.
+ *
+ */
+static void blur_rows(band_t *band) {
+    for (int y = band->start; y < band->end; y++) {
+        uint32_t *row = band->data + (size_t)y * band->stride;
+        uint32_t *tmp = band->tmp + (size_t)y * band->stride;
+        for (int pass = 0; pass < BOX_PASSES; pass++) {
+            band->kernel->row(tmp, row, band->width, band->param);
+            memcpy(row, tmp, (size_t)band->width * 4);
+        }
+    }
+}
+
+/*
+ * Blurs the band’s columns vertically, BOX_PASSES times, going down the rows
+ * with one running sum per channel and column.
+ *
+ */
+static void blur_columns(band_t *band) {
+    const int x0 = band->start;
+    const int n = band->end - band->start;
+    const int radius = band->param;
+    if (n <= 0)
+        return;
+    uint32_t *sums = malloc((size_t)n * 4 * sizeof(uint32_t));
+    if (sums == NULL)
+        return;
+
+    uint32_t *src = band->data, *dest = band->tmp;
+#define ROW(buf, y) ((buf) + (size_t)clamp_index((y), band->height) * band->stride + x0)
+    for (int pass = 0; pass < BOX_PASSES; pass++) {
+        memset(sums, '\0', (size_t)n * 4 * sizeof(uint32_t));
+        for (int i = -radius; i <= radius; i++)
+            band->kernel->accumulate(sums, ROW(src, i), NULL, n);
+        for (int y = 0; y < band->height; y++) {
+            band->kernel->emit(ROW(dest, y), sums, n, radius);
+            band->kernel->accumulate(sums, ROW(src, y + radius + 1), ROW(src, y - radius), n);
+        }
+        uint32_t *swap = src;
+        src = dest;
+        dest = swap;
+    }
+    /* After an odd number of passes, the result is in tmp. */
+    if (src != band->data) {
+        for (int y = 0; y < band->height; y++)
+            memcpy(ROW(band->data, y), ROW(src, y), (size_t)n * 4);
+    }
+#undef ROW
+    free(sums);
+}
+
+/*
+ * Blurs the image (--blur). The result is close to a Gaussian blur with the
+ * given standard deviation (in pixels): a box blur of radius r has a variance
+ * of r (r + 1) / 3, three of them add up to r (r + 1).
+ *
+ */
+void blur_image(cairo_surface_t *image, int sigma) {
+    if (sigma <= 0 || cairo_image_surface_get_format(image) != CAIRO_FORMAT_RGB24)
+        return;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    band_t band;
+    memset(&band, '\0', sizeof(band));
+    band.width = cairo_image_surface_get_width(image);
+    band.height = cairo_image_surface_get_height(image);
+    band.stride = cairo_image_surface_get_stride(image) / 4;
+    band.param = sigma;
+    const char *kernel;
+    band.kernel = select_blur_kernel(&kernel);
+
+    band.tmp = malloc((size_t)band.stride * band.height * 4);
+    if (band.tmp == NULL)
+        return;
+    cairo_surface_flush(image);
+    band.data = (uint32_t *)cairo_image_surface_get_data(image);
+
+    band.func = blur_rows;
+    const int row_threads = run_bands(&band, band.height, 1);
+    /* Bands of columns are kept apart by at least a cache line. */
+    band.func = blur_columns;
+    const int column_threads = run_bands(&band, band.width, 16);
+
+    free(band.tmp);
+    cairo_surface_mark_dirty(image);
+    DEBUG("blurred %d x %d px image with sigma %d in %.3f ms (%s kernel, %d threads for rows, %d for columns)\n",
+          band.width, band.height, sigma, elapsed_ms(&start), kernel, row_threads, column_threads);
+}
+
+/*
+ * Fills each block of the band’s rows (which are multiples of the block
+ * size) with its average color.
+ *
+ */
+static void pixelate_rows(band_t *band) {
+    const int size = band->param;
+    for (int y0 = band->start; y0 < band->end; y0 += size) {
+        const int rows = (band->height - y0 < size ? band->height - y0 : size);
+        for (int x0 = 0; x0 < band->width; x0 += size) {
+            const int cols = (band->width - x0 < size ? band->width - x0 : size);
+            uint32_t sum[4] = {0, 0, 0, 0};
+            for (int y = y0; y < y0 + rows; y++)
+                for (int x = x0; x < x0 + cols; x++)
+                    add_pixel_scalar(sum, band->data[(size_t)y * band->stride + x], 1);
+
+            const uint32_t px = average_scalar(sum, 1.0f / (rows * cols));
+            for (int y = y0; y < y0 + rows; y++)
+                for (int x = x0; x < x0 + cols; x++)
+                    band->data[(size_t)y * band->stride + x] = px;
+        }
+    }
+}
+
+/*
+ * Pixelates the image (--pixelate) into blocks of size x size pixels.
+ *
+ */
+void pixelate_image(cairo_surface_t *image, int size) {
+    if (size <= 1 || cairo_image_surface_get_format(image) != CAIRO_FORMAT_RGB24)
+        return;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    band_t band;
+    memset(&band, '\0', sizeof(band));
+    band.width = cairo_image_surface_get_width(image);
+    band.height = cairo_image_surface_get_height(image);
+    band.stride = cairo_image_surface_get_stride(image) / 4;
+    band.param = size;
+    cairo_surface_flush(image);
+    band.data = (uint32_t *)cairo_image_surface_get_data(image);
+
+    band.func = pixelate_rows;
+    run_bands(&band, band.height, size);
+
+    cairo_surface_mark_dirty(image);
+    DEBUG("pixelated %d x %d px image with %d px blocks in %.3f ms\n",
+          band.width, band.height, size, elapsed_ms(&start));
+}
@@ -0,0 +1,11 @@
+#ifndef _SCREENSHOT_H
+#define _SCREENSHOT_H
+
+#include <stdint.h>
+#include <cairo.h>
+
+cairo_surface_t *take_screenshot(uint32_t *resolution);
+void blur_image(cairo_surface_t *image, int sigma);
+void pixelate_image(cairo_surface_t *image, int size);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * trace.c: records spans (event dispatch, rendering, authentication, …) into
+ *          an in-memory ring buffer and writes them out as Chrome
+ *          trace-event JSON on exit, for --trace. The file can be loaded
+ *          into chrome://tracing or https://ui.perfetto.dev.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+bool trace_enabled = false;
+
+/* The most recent spans are kept, older ones are overwritten. */
+#define TRACE_CAPACITY 65536
+
+typedef struct {
+    /* Static strings, so recording does not need to copy anything. */
+    const char *name;
+    const char *arg_name;
+    int64_t arg;
+    uint64_t start_us;
+    uint64_t duration_us;
+    uint32_t tid;
+} trace_span_t;
+
+static trace_span_t *spans;
+/* Index of the next span, incremented atomically: spans are recorded by the
+ * main thread and by helper threads (e.g. the authentication thread). */
+static uint64_t next_span = 0;
+
+static FILE *trace_file;
+/* Only the process which ends up unlocking writes the trace, not the parent
+ * exiting after the fork. */
+static pid_t trace_pid;
+
+/* How many events each drain of the X11 connection handled, in power of two
+ * buckets: 1, 2–3, 4–7, …, and 128 or more. Only updated by the main
+ * thread. */
+#define DRAIN_BUCKETS 8
+static uint64_t drain_histogram[DRAIN_BUCKETS];
+
+static uint32_t next_tid = 1;
+static __thread uint32_t thread_tid = 0;
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Records a span which started at start_us (see trace_now()) and ends now.
+ * arg_name may be NULL if the span has no argument.
+ *
+ */
+void trace_span(const char *name, uint64_t start_us, const char *arg_name, int64_t arg) {
+    if (!trace_enabled)
+        return;
+
+    const uint64_t end_us = trace_now();
+    if (thread_tid == 0)
+        thread_tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+
+    const uint64_t index = __atomic_fetch_add(&next_span, 1, __ATOMIC_RELAXED);
+    trace_span_t *span = &spans[index % TRACE_CAPACITY];
+    span->name = name;
+    span->arg_name = arg_name;
+    span->arg = arg;
+    span->start_us = start_us;
+    span->duration_us = end_us - start_us;
+    span->tid = thread_tid;
+}
+
+/*
+ * Records that one drain of the X11 connection handled the given number of
+ * events, for the histogram written with the trace.
+ *
+ */
+void trace_drain(int events) {
+    if (!trace_enabled || events < 1)
+        return;
+
+    int bucket = 0;
+    while (bucket < DRAIN_BUCKETS - 1 && events >= (2 << bucket))
+        bucket++;
+    drain_histogram[bucket]++;
+}
+
+/*
+ * Writes the events-per-drain histogram as an instant event at the given
+ * time, so that it shows up with its arguments in the trace viewer.
+ *
+ */
+static void write_drain_histogram(uint64_t ts) {
+    fprintf(trace_file, "{\"name\": \"events_per_drain\", \"ph\": \"i\", \"s\": \"g\", \"ts\": %llu, \"pid\": %d, \"tid\": 0, \"args\": {",
+            (unsigned long long)ts, (int)trace_pid);
+    for (int i = 0; i < DRAIN_BUCKETS; i++) {
+        const int low = 1 << i;
+        if (i == DRAIN_BUCKETS - 1)
+            fprintf(trace_file, "\"%d+\": %llu", low, (unsigned long long)drain_histogram[i]);
+        else if (low == (2 << i) - 1)
+            fprintf(trace_file, "\"%d\": %llu, ", low, (unsigned long long)drain_histogram[i]);
+        else
+            fprintf(trace_file, "\"%d-%d\": %llu, ", low, (2 << i) - 1, (unsigned long long)drain_histogram[i]);
+    }
+    fprintf(trace_file, "}}");
+}
+
+/*
+ * Writes the recorded spans to the trace file. Called on exit.
+ *
+ */
+static void trace_write(void) {
+    if (!trace_enabled || getpid() != trace_pid)
+        return;
+    trace_enabled = false;
+
+    const uint64_t end = __atomic_load_n(&next_span, __ATOMIC_ACQUIRE);
+    const uint64_t begin = (end > TRACE_CAPACITY ? end - TRACE_CAPACITY : 0);
+
+    fprintf(trace_file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (uint64_t i = begin; i < end; i++) {
+        const trace_span_t *span = &spans[i % TRACE_CAPACITY];
+        fprintf(trace_file, "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %llu, \"pid\": %d, \"tid\": %u",
+                span->name, (unsigned long long)span->start_us, (unsigned long long)span->duration_us,
+                (int)trace_pid, span->tid);
+        if (span->arg_name != NULL)
+            fprintf(trace_file, ", \"args\": {\"%s\": %lld}", span->arg_name, (long long)span->arg);
+        fprintf(trace_file, "},\n");
+    }
+    write_drain_histogram(trace_now());
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+    if (begin > 0)
+        fprintf(stderr, "[i3lock] trace ring buffer overflowed, %llu spans were dropped\n",
+                (unsigned long long)begin);
+}
+
+/*
+ * Enables tracing. The file is opened right away, so that errors show up
+ * before the screen is locked, and written on exit.
+ *
+ */
+bool trace_open(const char *path) {
+    if ((trace_file = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "[i3lock] could not open trace file \"%s\": %s\n", path, strerror(errno));
+        return false;
+    }
+    if ((spans = calloc(TRACE_CAPACITY, sizeof(trace_span_t))) == NULL) {
+        fclose(trace_file);
+        return false;
+    }
+
+    trace_pid = getpid();
+    trace_enabled = true;
+    atexit(trace_write);
+    return true;
+}
+
+/*
+ * Makes the calling process the one which writes the trace. Called in the
+ * child after fork()ing, when the parent exits.
+ *
+ */
+void trace_adopt(void) {
+    trace_pid = getpid();
+}
@@ -0,0 +1,28 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Whether --trace is active. */
+extern bool trace_enabled;
+
+bool trace_open(const char *path);
+void trace_adopt(void);
+uint64_t trace_now(void);
+void trace_span(const char *name, uint64_t start_us, const char *arg_name, int64_t arg);
+void trace_drain(int events);
+
+/* Records a span from TRACE_BEGIN to TRACE_END. Costs a branch when tracing
+ * is disabled. */
+#define TRACE_BEGIN(start_var) \
+    uint64_t start_var = (trace_enabled ? trace_now() : 0)
+#define TRACE_END(start_var, name) \
+    TRACE_END_ARG(start_var, name, NULL, 0)
+#define TRACE_END_ARG(start_var, name, arg_name, arg)   \
+    do {                                                \
+        if (trace_enabled)                              \
+            trace_span(name, start_var, arg_name, arg); \
+    } while (0)
+
+#endif
@@ -11,6 +11,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <xcb/xcb.h>
 #include <ev.h>
 #include <cairo.h>
@@ -21,6 +24,9 @@
 #include "unlock_indicator.h"
 #include "randr.h"
 #include "dpi.h"
+#include "present.h"
+#include "xrender.h"
+#include "trace.h"
 
 #define BUTTON_RADIUS 90
 #define BUTTON_SPACE (BUTTON_RADIUS + 5)
@@ -65,6 +71,12 @@ extern bool show_failed_attempts;
 /* Number of failed unlock attempts. */
 extern int failed_attempts;
 
+/* The event loop, which schedules frames. */
+extern struct ev_loop *main_loop;
+
+/* Minimum time between two frames in seconds (--max-fps), 0 for no limit. */
+extern double min_frame_interval;
+
 /*******************************************************************************
  * Variables defined in xcb.c.
  ******************************************************************************/
@@ -84,187 +96,1442 @@ static xcb_visualtype_t *vistype;
 unlock_state_t unlock_state;
 auth_state_t auth_state;
 
-static void string_repeat(char *dest, const char *str, int n) {
-    if (n <= 0) return;
-    if (n >= 64) n = 64;
+/* At most this many monitors are painted separately (and get their own unlock
+ * indicator with -s all). */
+#define MAX_MONITORS 16
+
+/* The layout of the unlock indicator for one frame. */
+typedef struct {
+    /* The number of bullets to display (one for each character of the
+     * password, up to MAX_BULLETS). */
+    int bullets;
+    /* Text color. */
+    double red, green, blue;
+    /* The bullet drawn in the highlight color instead, or -1 (see
+     * animate_indicator()). */
+    int highlight;
+    double highlight_red, highlight_green, highlight_blue;
+    /* Where the text is displayed: on one monitor, or on each of them with
+     * -s all. 0 if there is nothing to draw. */
+    int count;
+    struct {
+        /* Origin of the text (the pen position of the first bullet), in
+         * device pixels. */
+        int x, y;
+        /* Area covered by the text, including some slack for antialiasing,
+         * clipped to the root window. */
+        Rect box;
+    } at[MAX_MONITORS];
+} indicator_t;
 
-    char *pa, *pb;
-    int slen = strlen(str);
+/* Additional pixels around the text extents, to not cut off antialiased
+ * glyph edges. */
+#define INDICATOR_PADDING 2
+
+/* At most this many bullets are displayed, even if the password is longer. */
+#define MAX_BULLETS 64
+
+/*
+ * Returns the smallest rectangle containing both a and b. Empty rectangles are
+ * ignored.
+ *
+ */
+static Rect rect_union(Rect a, Rect b) {
+    if (a.width == 0 || a.height == 0)
+        return b;
+    if (b.width == 0 || b.height == 0)
+        return a;
 
-    pa = dest + (n-1)*slen;
-    strcpy(pa, str);
-    pb = --pa + slen; 
-    while (pa>=dest) *pa-- = *pb--;
+    const int x1 = (a.x < b.x ? a.x : b.x);
+    const int y1 = (a.y < b.y ? a.y : b.y);
+    const int x2 = (a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width);
+    const int y2 = (a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height);
+    return (Rect){x1, y1, x2 - x1, y2 - y1};
 }
 
 /*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
+ * Returns the intersection of a and b, or an empty rectangle.
  *
  */
-void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
-    const double scaling_factor = get_dpi_value() / 96.0;
+static Rect rect_intersect(Rect a, Rect b) {
+    const int x1 = (a.x > b.x ? a.x : b.x);
+    const int y1 = (a.y > b.y ? a.y : b.y);
+    const int x2 = (a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width);
+    const int y2 = (a.y + a.height < b.y + b.height ? a.y + a.height : b.y + b.height);
+    if (x2 <= x1 || y2 <= y1)
+        return (Rect){0, 0, 0, 0};
+    return (Rect){x1, y1, x2 - x1, y2 - y1};
+}
 
-    if (!vistype)
-        vistype = get_root_visual_type(screen);
+/*
+ * Stores the parts of r which are not covered by hole in out (up to four
+ * strips: above, below, left and right of the hole) and returns their number.
+ *
+ */
+static int rect_subtract(Rect r, Rect hole, Rect *out) {
+    hole = rect_intersect(r, hole);
+    if (hole.width == 0) {
+        out[0] = r;
+        return 1;
+    }
 
-    /* Initialize cairo: Create one in-memory surface to render the unlock
-     * indicator on, create one XCB surface to actually draw (one or more,
-     * depending on the amount of screens) unlock indicators on. */
-    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, resolution[0], resolution[1]);
-    cairo_t *ctx = cairo_create(output);
+    int count = 0;
+    if (hole.y > r.y)
+        out[count++] = (Rect){r.x, r.y, r.width, hole.y - r.y};
+    if (hole.y + hole.height < r.y + r.height)
+        out[count++] = (Rect){r.x, hole.y + hole.height, r.width, (r.y + r.height) - (hole.y + hole.height)};
+    if (hole.x > r.x)
+        out[count++] = (Rect){r.x, hole.y, hole.x - r.x, hole.height};
+    if (hole.x + hole.width < r.x + r.width)
+        out[count++] = (Rect){hole.x + hole.width, hole.y, (r.x + r.width) - (hole.x + hole.width), hole.height};
+    return count;
+}
 
-    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
-    cairo_t *xcb_ctx = cairo_create(xcb_output);
+/*
+ * Clips the rectangle to the given resolution.
+ *
+ */
+static Rect rect_clip(Rect r, const uint32_t *resolution) {
+    int x1 = r.x, y1 = r.y;
+    int x2 = r.x + r.width, y2 = r.y + r.height;
+    if (x1 < 0)
+        x1 = 0;
+    if (y1 < 0)
+        y1 = 0;
+    if (x2 > (int)resolution[0])
+        x2 = resolution[0];
+    if (y2 > (int)resolution[1])
+        y2 = resolution[1];
+    if (x2 <= x1 || y2 <= y1)
+        return (Rect){0, 0, 0, 0};
+    return (Rect){x1, y1, x2 - x1, y2 - y1};
+}
+
+/* Number of bytes of pixel buffers allocated while rendering the current
+ * frame and since startup, for --debug. */
+static size_t frame_alloc_bytes = 0;
+static size_t total_alloc_bytes = 0;
+
+static void count_alloc(size_t bytes) {
+    frame_alloc_bytes += bytes;
+    total_alloc_bytes += bytes;
+}
+
+/* Number of pixels painted for the current frame, for --debug. Compared to
+ * the number of pixels which actually changed, this shows the overdraw. */
+static uint64_t frame_painted_px = 0;
+
+static uint64_t rect_area(Rect r) {
+    return (uint64_t)r.width * r.height;
+}
+
+/* The size of the image after move_image_to_server(), as cairo cannot tell
+ * the size of an XCB surface. */
+static int uploaded_width, uploaded_height;
+
+/* Everything a frame depends on besides the image and the
+ * unlock/authentication state: derived from the configuration, the root
+ * window’s size, the RandR outputs and the DPI. It is only rebuilt when one of
+ * them changes (see invalidate_render_state()) and never modified while a
+ * frame is rendered, so the background workers read it without locking. */
+typedef struct {
+    uint32_t resolution[2];
+    long dpi;
+    double scaling_factor;
+    /* Hash of the monitor layout (xr_resolutions). */
+    uint64_t layout;
+    /* The background color (-c), components from 0 to 1. */
+    double red, green, blue;
+    /* The parts of the root window which are displayed on a monitor. */
+    int num_visible;
+    Rect visible[MAX_MONITORS];
+    /* The monitors to display the unlock indicator on (-s). */
+    int num_indicator_monitors;
+    Rect indicator_monitors[MAX_MONITORS];
+} render_state_t;
+
+static render_state_t render_state;
+static bool render_state_valid = false;
+
+/*
+ * Returns the parts of the root window which are displayed on a monitor, in
+ * rects (at most MAX_MONITORS). Mirrored monitors are only returned once.
+ *
+ */
+static int visible_rects(uint32_t *resolution, Rect *rects) {
+    if (xr_screens <= 0) {
+        rects[0] = (Rect){0, 0, resolution[0], resolution[1]};
+        return 1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < xr_screens && count < MAX_MONITORS; i++) {
+        const Rect r = rect_clip(xr_resolutions[i], resolution);
+        if (r.width == 0)
+            continue;
+        bool duplicate = false;
+        for (int j = 0; j < count; j++) {
+            if (memcmp(&rects[j], &r, sizeof(Rect)) == 0)
+                duplicate = true;
+        }
+        if (!duplicate)
+            rects[count++] = r;
+    }
+    return count;
+}
+
+/*
+ * Marks the render state as outdated, e.g. because the outputs changed. It is
+ * rebuilt before it is used next.
+ *
+ */
+void invalidate_render_state(void) {
+    render_state_valid = false;
+}
+
+/*
+ * Returns the render state for the given resolution, rebuilding it if
+ * necessary.
+ *
+ */
+static const render_state_t *get_render_state(uint32_t *resolution) {
+    render_state_t *state = &render_state;
+    if (render_state_valid &&
+        state->resolution[0] == resolution[0] &&
+        state->resolution[1] == resolution[1])
+        return state;
+
+    memset(state, 0, sizeof(render_state_t));
+    state->resolution[0] = resolution[0];
+    state->resolution[1] = resolution[1];
+    state->dpi = get_dpi_value();
+    state->scaling_factor = state->dpi / 96.0;
+
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *bytes = (const unsigned char *)xr_resolutions;
+    for (size_t i = 0; i < xr_screens * sizeof(Rect); i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    state->layout = hash ^ (uint64_t)xr_screens;
 
-    /* After the first iteration, the pixmap will still contain the previous
-     * contents. Explicitly clear the entire pixmap with the background color
-     * first to get back into a defined state: */
     char strgroups[3][3] = {{color[0], color[1], '\0'},
                             {color[2], color[3], '\0'},
                             {color[4], color[5], '\0'}};
-    uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
-                         (strtol(strgroups[1], NULL, 16)),
-                         (strtol(strgroups[2], NULL, 16))};
-    cairo_set_source_rgb(xcb_ctx, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
-    cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-    cairo_fill(xcb_ctx);
+    state->red = strtol(strgroups[0], NULL, 16) / 255.0;
+    state->green = strtol(strgroups[1], NULL, 16) / 255.0;
+    state->blue = strtol(strgroups[2], NULL, 16) / 255.0;
 
-    if (img) {
+    state->num_visible = visible_rects(resolution, state->visible);
+
+    if (xr_screens > 0 && show_on_screen == SHOW_ON_ALL_SCREENS) {
+        state->num_indicator_monitors = state->num_visible;
+        memcpy(state->indicator_monitors, state->visible, sizeof(state->visible));
+    } else if (xr_screens > 0) {
+        int selected_screen = 0;
+        // Check if a specific screen was requested
+        if (show_on_screen >= 0 && show_on_screen < xr_screens)
+            selected_screen = show_on_screen;
+        else if (show_on_screen >= 0 && show_on_screen >= xr_screens)
+            DEBUG("screen index was %d out of bounds, found %d screens, drawing on 0\n", show_on_screen, xr_screens);
+        else
+            DEBUG("no screen index given, drawing on 0\n");
+        state->num_indicator_monitors = 1;
+        state->indicator_monitors[0] = xr_resolutions[selected_screen];
+    } else {
+        /* We have no information about the screen sizes/positions, so we just
+         * place the unlock indicator in the middle of the X root window and
+         * hope for the best. */
+        state->num_indicator_monitors = 1;
+        state->indicator_monitors[0] = (Rect){0, 0, resolution[0], resolution[1]};
+    }
+
+    DEBUG("render state: %d x %d px, %d visible monitor(s), DPI %ld\n",
+          resolution[0], resolution[1], state->num_visible, state->dpi);
+    render_state_valid = true;
+    return state;
+}
+
+/*
+ * Returns whether the given image is opaque and, if so, the part of the root
+ * window it covers in extents. Parts of the screen under an opaque image do
+ * not need to be filled with the background color first.
+ *
+ */
+static bool image_opaque_extents(cairo_surface_t *image, const uint32_t *resolution, Rect *extents) {
+    if (cairo_surface_get_content(image) != CAIRO_CONTENT_COLOR)
+        return false;
+
+    if (tile) {
+        *extents = (Rect){0, 0, resolution[0], resolution[1]};
+        return true;
+    }
+
+    int width, height;
+    if (cairo_surface_get_type(image) == CAIRO_SURFACE_TYPE_XCB) {
+        width = uploaded_width;
+        height = uploaded_height;
+    } else {
+        width = cairo_image_surface_get_width(image);
+        height = cairo_image_surface_get_height(image);
+    }
+    /* A cropped image keeps its position (see crop_image()). */
+    double x_offset, y_offset;
+    cairo_surface_get_device_offset(image, &x_offset, &y_offset);
+    const int x = -lround(x_offset), y = -lround(y_offset);
+    *extents = rect_clip((Rect){x, y, width, height}, resolution);
+    return true;
+}
+
+/*
+ * Paints the background color and the given image (if any) onto the given
+ * area of the context. The color is only painted where an opaque image does not
+ * cover it. Returns the number of pixels painted.
+ *
+ */
+static uint64_t paint_background(cairo_t *ctx, const render_state_t *state, cairo_surface_t *image, Rect area) {
+    uint64_t painted = 0;
+
+    /* The target might contain previous contents. Explicitly clear it with
+     * the background color first to get back into a defined state: */
+    Rect exposed[4];
+    Rect extents;
+    int num_exposed = 1;
+    exposed[0] = area;
+    const bool opaque = (image && image_opaque_extents(image, state->resolution, &extents));
+    if (opaque)
+        num_exposed = rect_subtract(area, extents, exposed);
+    if (num_exposed > 0) {
+        cairo_set_source_rgb(ctx, state->red, state->green, state->blue);
+        for (int i = 0; i < num_exposed; i++) {
+            cairo_rectangle(ctx, exposed[i].x, exposed[i].y, exposed[i].width, exposed[i].height);
+            painted += rect_area(exposed[i]);
+        }
+        cairo_fill(ctx);
+    }
+
+    if (image) {
+        cairo_save(ctx);
+        cairo_rectangle(ctx, area.x, area.y, area.width, area.height);
+        cairo_clip(ctx);
         if (!tile) {
-            cairo_set_source_surface(xcb_ctx, img, 0, 0);
-            cairo_paint(xcb_ctx);
+            cairo_set_source_surface(ctx, image, 0, 0);
+            cairo_paint(ctx);
         } else {
             /* create a pattern and fill a rectangle as big as the screen */
             cairo_pattern_t *pattern;
-            pattern = cairo_pattern_create_for_surface(img);
-            cairo_set_source(xcb_ctx, pattern);
+            pattern = cairo_pattern_create_for_surface(image);
+            cairo_set_source(ctx, pattern);
             cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-            cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-            cairo_fill(xcb_ctx);
+            cairo_rectangle(ctx, 0, 0, state->resolution[0], state->resolution[1]);
+            cairo_fill(ctx);
             cairo_pattern_destroy(pattern);
         }
+        cairo_restore(ctx);
+        /* An image with an alpha channel is accounted for as covering the
+         * whole area. */
+        painted += (opaque ? rect_area(rect_intersect(area, extents)) : rect_area(area));
     }
+    return painted;
+}
 
-    if (unlock_indicator &&
-        (unlock_state >= STATE_KEY_PRESSED || auth_state > STATE_AUTH_IDLE)) {
-        if (input_position > 0)
-            last_input_position = input_position;
+/* Renders the background of one monitor into a shared memory image, see
+ * draw_background_shm(). */
+typedef struct {
+    Rect rect;
+    shm_image_t *shm;
+    /* Output: the number of pixels painted. */
+    uint64_t painted;
+} monitor_job_t;
 
-        cairo_scale(ctx, scaling_factor, scaling_factor);
+/* The jobs of one draw_background_shm() call, which the worker threads take
+ * turns picking from. */
+static struct {
+    pthread_mutex_t lock;
+    monitor_job_t *jobs;
+    int count;
+    int next;
+    const render_state_t *state;
+} monitor_jobs = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
-        /* Display a (centered) text of the current PAM state. */
-        char *text = malloc(256);
-        strcpy(text, "");
+static void render_monitor(monitor_job_t *job, const render_state_t *state) {
+    /* cairo surfaces must not be shared between threads, so each job gets its
+     * own surface for the (read-only) pixels of the image. */
+    cairo_surface_t *source = NULL;
+    if (img) {
+        double x_offset, y_offset;
+        cairo_surface_get_device_offset(img, &x_offset, &y_offset);
+        source = cairo_image_surface_create_for_data(
+            cairo_image_surface_get_data(img), cairo_image_surface_get_format(img),
+            cairo_image_surface_get_width(img), cairo_image_surface_get_height(img),
+            cairo_image_surface_get_stride(img));
+        cairo_surface_set_device_offset(source, x_offset, y_offset);
+    }
 
-        if (auth_state == STATE_AUTH_WRONG || auth_state == STATE_I3LOCK_LOCK_FAILED)
-            string_repeat(text, "•", last_input_position);
-        else
-            string_repeat(text, "•", input_position);
-
-        cairo_set_source_rgb(ctx, 0, 0, 0);
-        cairo_select_font_face(ctx, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-        cairo_set_font_size(ctx, 80.0);
-
-        switch (auth_state) {
-            case STATE_AUTH_VERIFY:
-                cairo_set_source_rgb(ctx, 84.0f / 255, 110.0f / 255, 122.0f / 255);
-                break;
-            case STATE_AUTH_LOCK:
-                cairo_set_source_rgb(ctx, 84.0f / 255, 110.0f / 255, 122.0f / 255);
-                break;
-            case STATE_AUTH_WRONG:
-                if (unlock_state < STATE_KEY_PRESSED)
-                    cairo_set_source_rgb(ctx, 255.0f / 255, 83.0f / 255, 112.0f / 255);
-                else
-                    cairo_set_source_rgb(ctx, 1, 1, 1);
-                break;
-            case STATE_I3LOCK_LOCK_FAILED:
-                cairo_set_source_rgb(ctx, 255.0f / 255, 83.0f / 255, 112.0f / 255);
-                break;
-            default:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) strcpy(text, "");
-                cairo_set_source_rgb(ctx, 1, 1, 1);
-                break;
-        }
+    cairo_surface_t *output = cairo_image_surface_create_for_data(
+        job->shm->data, CAIRO_FORMAT_RGB24, job->shm->width, job->shm->height, job->shm->stride);
+    cairo_t *ctx = cairo_create(output);
+    cairo_translate(ctx, -job->rect.x, -job->rect.y);
+    job->painted = paint_background(ctx, state, source, job->rect);
+    cairo_destroy(ctx);
+    cairo_surface_finish(output);
+    cairo_surface_destroy(output);
+    if (source)
+        cairo_surface_destroy(source);
+}
 
-        cairo_text_extents_t extents;
-        double x, y;
-
-        int screen_center_x, screen_center_y, screen_offset_x, screen_offset_y;
-
-        if (xr_screens > 0) {
-            int selected_screen = 0;
-            // Check if a specific screen was requested
-            if (show_on_screen >= 0 && show_on_screen < xr_screens)
-                selected_screen = show_on_screen;
-            else if (show_on_screen >= 0 && show_on_screen >= xr_screens)
-                DEBUG("screen index was %d out of bounds, found %d screens, drawing on 0\n", show_on_screen, xr_screens);
-            else
-                DEBUG("no screen index given, drawing on 0\n");
-
-            screen_center_x = xr_resolutions[selected_screen].width / 2;
-            screen_center_y = xr_resolutions[selected_screen].height / 2;
-            screen_offset_x = xr_resolutions[selected_screen].x;
-            screen_offset_y = xr_resolutions[selected_screen].y;
-        } else {
-            /* We have no information about the screen sizes/positions, so we just
-             * place the unlock indicator in the middle of the X root window and
-             * hope for the best. */
-            screen_center_x = (last_resolution[0] / 2);
-            screen_center_y = (last_resolution[1] / 2);
-            screen_offset_x = 0;
-            screen_offset_y = 0;
+static void *monitor_worker(void *arg) {
+    while (true) {
+        pthread_mutex_lock(&monitor_jobs.lock);
+        const int i = monitor_jobs.next++;
+        pthread_mutex_unlock(&monitor_jobs.lock);
+        if (i >= monitor_jobs.count)
+            return NULL;
+        render_monitor(&monitor_jobs.jobs[i], monitor_jobs.state);
+    }
+}
+
+/*
+ * Renders the background of each monitor into a shared memory image and
+ * uploads them onto the given pixmap, one request per monitor. The monitors
+ * are rendered concurrently by a small pool of threads. Returns false if
+ * MIT-SHM cannot be used.
+ *
+ */
+static bool draw_background_shm(xcb_pixmap_t pixmap, const render_state_t *state, uint64_t *painted) {
+    /* Painting a server-side image into client memory would download it. */
+    if (img && cairo_surface_get_type(img) == CAIRO_SURFACE_TYPE_XCB)
+        return false;
+
+    const int count = state->num_visible;
+    monitor_job_t jobs[MAX_MONITORS];
+    for (int i = 0; i < count; i++) {
+        jobs[i].rect = state->visible[i];
+        jobs[i].shm = shm_image_create(conn, screen, jobs[i].rect.width, jobs[i].rect.height);
+        if (jobs[i].shm == NULL) {
+            for (int j = 0; j < i; j++)
+                shm_image_destroy(conn, jobs[j].shm);
+            return false;
         }
+        count_alloc((size_t)jobs[i].shm->stride * jobs[i].shm->height);
+    }
+
+    /* The workers read the image’s pixels directly. */
+    if (img)
+        cairo_surface_flush(img);
+
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > count)
+        workers = count;
+    if (workers < 1)
+        workers = 1;
+    monitor_jobs.jobs = jobs;
+    monitor_jobs.count = count;
+    monitor_jobs.next = 0;
+    monitor_jobs.state = state;
+
+    pthread_t threads[MAX_MONITORS];
+    bool started[MAX_MONITORS];
+    for (int i = 1; i < workers; i++)
+        started[i] = (pthread_create(&threads[i], NULL, monitor_worker, NULL) == 0);
+    monitor_worker(NULL);
+    for (int i = 1; i < workers; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+
+    DEBUG("uploading background of %d monitor(s) via MIT-SHM (%ld threads)\n", count, workers);
+    for (int i = 0; i < count; i++) {
+        shm_image_put(conn, screen, jobs[i].shm, pixmap, jobs[i].rect.x, jobs[i].rect.y);
+        shm_image_destroy(conn, jobs[i].shm);
+        *painted += jobs[i].painted;
+    }
+    return true;
+}
+
+/*
+ * Uploads the image (-i) into a pixmap and frees the client-side copy
+ * (--low-memory). cairo then composites it on the server when drawing the
+ * background.
+ *
+ */
+void move_image_to_server(void) {
+    if (!img || cairo_surface_get_type(img) == CAIRO_SURFACE_TYPE_XCB)
+        return;
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    const int width = cairo_image_surface_get_width(img);
+    const int height = cairo_image_surface_get_height(img);
+
+    /* The similar surface is a pixmap with an alpha channel, if the image has
+     * one, so that it is still blended onto the background color. */
+    cairo_surface_t *root = cairo_xcb_surface_create(conn, screen->root, vistype, width, height);
+    cairo_surface_t *uploaded = cairo_surface_create_similar(root, cairo_surface_get_content(img), width, height);
+    cairo_surface_destroy(root);
+
+    /* A cropped image keeps its position (see crop_image()). */
+    double x_offset, y_offset;
+    cairo_surface_get_device_offset(img, &x_offset, &y_offset);
 
-        cairo_text_extents(ctx, text, &extents);
-        x = screen_offset_x + screen_center_x - ((extents.width / 2) + extents.x_bearing);
-        y = screen_offset_y + screen_center_y - ((extents.height / 2) + extents.y_bearing);
+    cairo_t *ctx = cairo_create(uploaded);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(ctx, img, x_offset, y_offset);
+    cairo_paint(ctx);
+    cairo_destroy(ctx);
+    cairo_surface_flush(uploaded);
+    cairo_surface_set_device_offset(uploaded, x_offset, y_offset);
 
-        cairo_move_to(ctx, x, y);
-        cairo_show_text(ctx, text);
-        cairo_close_path(ctx);
+    if (cairo_surface_status(uploaded) != CAIRO_STATUS_SUCCESS ||
+        cairo_surface_get_type(uploaded) != CAIRO_SURFACE_TYPE_XCB) {
+        DEBUG("could not upload the image, keeping it in memory\n");
+        cairo_surface_destroy(uploaded);
+        return;
     }
 
-    cairo_set_source_surface(xcb_ctx, output, 0, 0);
-    cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-    cairo_fill(xcb_ctx);
+    DEBUG("uploaded the %d x %d px image, freeing the client-side copy\n", width, height);
+    cairo_surface_destroy(img);
+    img = uploaded;
+    uploaded_width = width;
+    uploaded_height = height;
+}
+
+/* With -t, the tile composed onto the background color and uploaded to the X
+ * server once. The X server then fills the background with it by itself, and
+ * frames are restored from it instead of from a screen-sized layer. */
+static xcb_pixmap_t tile_pixmap = XCB_NONE;
+static xcb_gcontext_t tile_gc = XCB_NONE;
 
-    cairo_surface_destroy(xcb_output);
+/*
+ * Uploads the tile if it was not uploaded yet. Returns false if the image is
+ * not tiled.
+ *
+ */
+static bool ensure_tile_pixmap(const render_state_t *state) {
+    if (!tile || !img)
+        return false;
+    if (tile_pixmap != XCB_NONE)
+        return true;
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    int width, height;
+    if (cairo_surface_get_type(img) == CAIRO_SURFACE_TYPE_XCB) {
+        width = uploaded_width;
+        height = uploaded_height;
+    } else {
+        width = cairo_image_surface_get_width(img);
+        height = cairo_image_surface_get_height(img);
+    }
+    if (width <= 0 || height <= 0)
+        return false;
+
+    /* An image with an alpha channel is blended onto the color here once, so
+     * that the tile is opaque. */
+    tile_pixmap = xcb_generate_id(conn);
+    xcb_create_pixmap(conn, screen->root_depth, tile_pixmap, screen->root, width, height);
+    cairo_surface_t *output = cairo_xcb_surface_create(conn, tile_pixmap, vistype, width, height);
+    cairo_t *ctx = cairo_create(output);
+    cairo_set_source_rgb(ctx, state->red, state->green, state->blue);
+    cairo_paint(ctx);
+    cairo_set_source_surface(ctx, img, 0, 0);
+    cairo_paint(ctx);
+    cairo_destroy(ctx);
+    cairo_surface_flush(output);
     cairo_surface_destroy(output);
+
+    tile_gc = xcb_generate_id(conn);
+    xcb_create_gc(conn, tile_gc, tile_pixmap, XCB_GC_FILL_STYLE | XCB_GC_TILE,
+                  (uint32_t[]){XCB_FILL_STYLE_TILED, tile_pixmap});
+    DEBUG("uploaded %d x %d px tile\n", width, height);
+    count_alloc((size_t)width * height * 4);
+    return true;
+}
+
+static void free_tile_pixmap(void) {
+    if (tile_pixmap == XCB_NONE)
+        return;
+    xcb_free_gc(conn, tile_gc);
+    xcb_free_pixmap(conn, tile_pixmap);
+    tile_gc = XCB_NONE;
+    tile_pixmap = XCB_NONE;
+}
+
+/*
+ * Draws the background color and the image (if any) onto the given pixmap.
+ * Only the parts of the root window which are displayed on a monitor are
+ * painted, each pixel once where the image is opaque.
+ *
+ */
+static void draw_background(xcb_pixmap_t pixmap, const render_state_t *state) {
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    uint64_t visible = 0;
+    for (int i = 0; i < state->num_visible; i++)
+        visible += rect_area(state->visible[i]);
+
+    if (ensure_tile_pixmap(state)) {
+        for (int i = 0; i < state->num_visible; i++) {
+            const Rect r = state->visible[i];
+            xcb_poly_fill_rectangle(conn, pixmap, tile_gc, 1,
+                                    &(xcb_rectangle_t){r.x, r.y, r.width, r.height});
+        }
+        DEBUG("background: tiled %" PRIu64 " visible px on the X server\n", visible);
+        return;
+    }
+
+    /* Painting only the color is a single request, which is cheaper than
+     * uploading an image of it. */
+    uint64_t painted = 0;
+    if (!img || !draw_background_shm(pixmap, state, &painted)) {
+        cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, pixmap, vistype, state->resolution[0], state->resolution[1]);
+        cairo_t *xcb_ctx = cairo_create(xcb_output);
+        for (int i = 0; i < state->num_visible; i++)
+            painted += paint_background(xcb_ctx, state, img, state->visible[i]);
+        cairo_surface_destroy(xcb_output);
+        cairo_destroy(xcb_ctx);
+    }
+
+    DEBUG("background: painted %" PRIu64 " px for %" PRIu64 " visible px (overdraw %.2f)\n",
+          painted, visible, visible > 0 ? (double)painted / visible : 0.0);
+}
+
+/*
+ * Sets the font used for the unlock indicator on the given context.
+ *
+ */
+static void set_indicator_font(cairo_t *ctx, double scaling_factor) {
+    cairo_select_font_face(ctx, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(ctx, 80.0 * scaling_factor);
+}
+
+/* The bullet glyph, rasterized once per scaling factor into an alpha mask.
+ * The indicator is drawn by painting its color through this mask once per
+ * bullet, so the font is only resolved when the DPI changes. */
+static struct {
+    cairo_surface_t *mask;
+    double scaling_factor;
+    /* Offset of the mask’s origin relative to the pen position. */
+    int x, y;
+    int width, height;
+    /* Distance between the pen positions of two bullets, rounded so that
+     * each bullet is painted at whole pixels. */
+    int advance;
+    /* The glyph’s ink extents, for centering the text. */
+    double x_bearing, y_bearing, ink_width, ink_height;
+    /* Whether the mask was uploaded as the Render glyph (--xrender). */
+    bool uploaded;
+} bullet;
+
+/*
+ * Rasterizes the bullet glyph if it was not rasterized for the current
+ * scaling factor yet.
+ *
+ */
+static bool ensure_bullet_glyph(double scaling_factor) {
+    if (bullet.mask != NULL && bullet.scaling_factor == scaling_factor)
+        return true;
+
+    if (bullet.mask != NULL) {
+        cairo_surface_destroy(bullet.mask);
+        bullet.mask = NULL;
+    }
+
+    /* Measure the glyph. */
+    cairo_surface_t *measure = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+    cairo_t *ctx = cairo_create(measure);
+    cairo_text_extents_t extents;
+    set_indicator_font(ctx, scaling_factor);
+    cairo_text_extents(ctx, "•", &extents);
     cairo_destroy(ctx);
-    cairo_destroy(xcb_ctx);
+    cairo_surface_destroy(measure);
+
+    bullet.x = floor(extents.x_bearing) - INDICATOR_PADDING;
+    bullet.y = floor(extents.y_bearing) - INDICATOR_PADDING;
+    bullet.width = ceil(extents.x_bearing + extents.width) + INDICATOR_PADDING - bullet.x;
+    bullet.height = ceil(extents.y_bearing + extents.height) + INDICATOR_PADDING - bullet.y;
+    bullet.advance = (lround(extents.x_advance) > 0 ? lround(extents.x_advance) : 1);
+    bullet.x_bearing = extents.x_bearing;
+    bullet.y_bearing = extents.y_bearing;
+    bullet.ink_width = extents.width;
+    bullet.ink_height = extents.height;
+
+    DEBUG("rasterizing %d x %d px bullet glyph\n", bullet.width, bullet.height);
+    bullet.mask = cairo_image_surface_create(CAIRO_FORMAT_A8, bullet.width, bullet.height);
+    if (cairo_surface_status(bullet.mask) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(bullet.mask);
+        bullet.mask = NULL;
+        return false;
+    }
+    count_alloc((size_t)cairo_image_surface_get_stride(bullet.mask) * bullet.height);
+
+    ctx = cairo_create(bullet.mask);
+    set_indicator_font(ctx, scaling_factor);
+    cairo_move_to(ctx, -bullet.x, -bullet.y);
+    cairo_show_text(ctx, "•");
+    cairo_destroy(ctx);
+    cairo_surface_flush(bullet.mask);
+
+    bullet.scaling_factor = scaling_factor;
+    bullet.uploaded = false;
+    return true;
+}
+
+/*******************************************************************************
+ * Animations.
+ ******************************************************************************/
+
+/* While the unlock indicator is animated, frames are rendered by a single
+ * repeating timer at the frame rate (--max-fps, or ANIMATION_FPS). It is
+ * stopped as soon as nothing is animated anymore, so that an idle screen does
+ * not cause any wakeups. Each frame only restores and redraws the area of the
+ * indicator, as with any other change of the indicator. */
+#define ANIMATION_FPS 60
+
+/* While verifying, a highlighted bullet sweeps across the text once per
+ * period. */
+#define VERIFY_SWEEP_PERIOD 1.0
+/* When the password was wrong, the bullets fade from white to red. */
+#define WRONG_FADE_DURATION 0.4
+
+typedef enum {
+    ANIMATION_NONE = 0,
+    ANIMATION_VERIFY,
+    ANIMATION_WRONG,
+} animation_t;
+
+static animation_t animation = ANIMATION_NONE;
+static ev_tstamp animation_start;
+/* Whether the last layout was still animating, i.e. needs another frame. */
+static bool animating = false;
+static ev_timer animation_timer;
+static bool animation_timer_initialized = false;
+
+/*
+ * Returns the time since the given animation started, restarting the clock
+ * when the animation changed.
+ *
+ */
+static double animation_time(animation_t wanted) {
+    const ev_tstamp now = ev_now(main_loop);
+    if (wanted != animation) {
+        animation = wanted;
+        animation_start = now;
+    }
+    return now - animation_start;
 }
 
-static xcb_pixmap_t bg_pixmap = XCB_NONE;
+/*
+ * Applies the animation of the current state to the given indicator, at the
+ * current time of the event loop.
+ *
+ */
+static void animate_indicator(indicator_t *ind) {
+    animation_t wanted = ANIMATION_NONE;
+    if (main_loop != NULL && ind->bullets > 0) {
+        if (auth_state == STATE_AUTH_VERIFY || auth_state == STATE_AUTH_LOCK)
+            wanted = ANIMATION_VERIFY;
+        else if (auth_state == STATE_AUTH_WRONG && unlock_state < STATE_KEY_PRESSED)
+            wanted = ANIMATION_WRONG;
+    }
+    const double t = (wanted != ANIMATION_NONE ? animation_time(wanted) : 0);
+    animation = wanted;
+    animating = false;
+
+    switch (wanted) {
+        case ANIMATION_VERIFY: {
+            const double phase = fmod(t, VERIFY_SWEEP_PERIOD) / VERIFY_SWEEP_PERIOD;
+            ind->highlight = (int)(phase * ind->bullets);
+            ind->highlight_red = ind->highlight_green = ind->highlight_blue = 1;
+            animating = true;
+            break;
+        }
+        case ANIMATION_WRONG: {
+            const double k = (t < WRONG_FADE_DURATION ? t / WRONG_FADE_DURATION : 1);
+            ind->red = 1 + (ind->red - 1) * k;
+            ind->green = 1 + (ind->green - 1) * k;
+            ind->blue = 1 + (ind->blue - 1) * k;
+            animating = (k < 1);
+            break;
+        }
+        case ANIMATION_NONE:
+            break;
+    }
+}
+
+static void animation_timer_cb(EV_P_ ev_timer *w, int revents) {
+    redraw_screen();
+}
 
 /*
- * Releases the current background pixmap so that the next redraw_screen() call
- * will allocate a new one with the updated resolution.
+ * Starts the frame clock if the last frame was animating, stops it otherwise.
+ *
+ */
+static void update_animation_timer(void) {
+    if (main_loop == NULL)
+        return;
+    if (!animation_timer_initialized) {
+        const double interval = (min_frame_interval > 0 ? min_frame_interval : 1.0 / ANIMATION_FPS);
+        ev_timer_init(&animation_timer, animation_timer_cb, interval, interval);
+        animation_timer_initialized = true;
+    }
+
+    if (animating && !ev_is_active(&animation_timer)) {
+        DEBUG("starting the animation clock\n");
+        ev_timer_start(main_loop, &animation_timer);
+    } else if (!animating && ev_is_active(&animation_timer)) {
+        DEBUG("nothing is animated, stopping the animation clock\n");
+        ev_timer_stop(main_loop, &animation_timer);
+    }
+}
+
+/*
+ * Computes what the unlock indicator looks like in the current
+ * unlock/authentication state and where it is placed. The given context is
+ * only used to measure the text.
+ *
+ */
+static void layout_indicator(const render_state_t *state, indicator_t *ind) {
+    memset(ind, '\0', sizeof(indicator_t));
+    ind->highlight = -1;
+
+    if (!unlock_indicator ||
+        (unlock_state < STATE_KEY_PRESSED && auth_state == STATE_AUTH_IDLE))
+        return;
+
+    if (input_position > 0)
+        last_input_position = input_position;
+
+    /* Display a (centered) text of the current PAM state. */
+    if (auth_state == STATE_AUTH_WRONG || auth_state == STATE_I3LOCK_LOCK_FAILED)
+        ind->bullets = last_input_position;
+    else
+        ind->bullets = input_position;
+    if (ind->bullets > MAX_BULLETS)
+        ind->bullets = MAX_BULLETS;
+
+    switch (auth_state) {
+        case STATE_AUTH_VERIFY:
+        case STATE_AUTH_LOCK:
+            ind->red = 84.0f / 255;
+            ind->green = 110.0f / 255;
+            ind->blue = 122.0f / 255;
+            break;
+        case STATE_AUTH_WRONG:
+            if (unlock_state < STATE_KEY_PRESSED) {
+                ind->red = 255.0f / 255;
+                ind->green = 83.0f / 255;
+                ind->blue = 112.0f / 255;
+            } else {
+                ind->red = ind->green = ind->blue = 1;
+            }
+            break;
+        case STATE_I3LOCK_LOCK_FAILED:
+            ind->red = 255.0f / 255;
+            ind->green = 83.0f / 255;
+            ind->blue = 112.0f / 255;
+            break;
+        default:
+            if (unlock_state == STATE_NOTHING_TO_DELETE)
+                ind->bullets = 0;
+            ind->red = ind->green = ind->blue = 1;
+            break;
+    }
+
+    if (ind->bullets <= 0 || !ensure_bullet_glyph(state->scaling_factor)) {
+        ind->bullets = 0;
+        return;
+    }
+    animate_indicator(ind);
+
+    /* The extents of the whole text follow from the glyph’s extents. */
+    const double text_width = (ind->bullets - 1) * bullet.advance + bullet.ink_width;
+    for (int i = 0; i < state->num_indicator_monitors; i++) {
+        const Rect monitor = state->indicator_monitors[i];
+        const int screen_center_x = monitor.width / 2;
+        const int screen_center_y = monitor.height / 2;
+        const int x = lround(monitor.x + screen_center_x - ((text_width / 2) + bullet.x_bearing));
+        const int y = lround(monitor.y + screen_center_y - ((bullet.ink_height / 2) + bullet.y_bearing));
+
+        const int x1 = x + bullet.x;
+        const int y1 = y + bullet.y;
+        const int x2 = x1 + (ind->bullets - 1) * bullet.advance + bullet.width;
+        const int y2 = y1 + bullet.height;
+        const Rect box = rect_clip((Rect){x1, y1, x2 - x1, y2 - y1}, state->resolution);
+        if (box.width == 0)
+            continue;
+        ind->at[ind->count].x = x;
+        ind->at[ind->count].y = y;
+        ind->at[ind->count].box = box;
+        ind->count++;
+    }
+}
+
+/* Offscreen surface the unlock indicator is rendered on before being
+ * composited onto the pixmap. It is large enough to hold the widest possible
+ * indicator and is kept across redraws. */
+static cairo_surface_t *indicator_surface = NULL;
+static cairo_t *indicator_ctx = NULL;
+
+/* The scaling factor indicator_surface was allocated for. */
+static double indicator_scaling_factor;
+
+/*
+ * (Re-)allocates indicator_surface if the DPI changed since it was allocated.
+ *
+ */
+static bool ensure_indicator_surface(void) {
+    if (indicator_surface != NULL &&
+        indicator_scaling_factor == bullet.scaling_factor)
+        return true;
+
+    if (indicator_surface != NULL) {
+        cairo_destroy(indicator_ctx);
+        cairo_surface_destroy(indicator_surface);
+        indicator_ctx = NULL;
+        indicator_surface = NULL;
+    }
+
+    /* Large enough for the widest possible text. */
+    const int width = (MAX_BULLETS - 1) * bullet.advance + bullet.width;
+    const int height = bullet.height;
+
+    DEBUG("allocating %d x %d px indicator surface\n", width, height);
+    indicator_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    if (cairo_surface_status(indicator_surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(indicator_surface);
+        indicator_surface = NULL;
+        return false;
+    }
+    count_alloc((size_t)cairo_image_surface_get_stride(indicator_surface) * height);
+    indicator_ctx = cairo_create(indicator_surface);
+
+    indicator_scaling_factor = bullet.scaling_factor;
+    return true;
+}
+
+/*
+ * Draws the unlock indicator onto the given context. The bullets are painted
+ * onto indicator_surface through the cached glyph mask once, then the area
+ * they cover is composited onto the context at each placement.
+ *
+ */
+static void draw_indicator(cairo_t *xcb_ctx, const indicator_t *ind) {
+    if (ind->count == 0 || !ensure_indicator_surface())
+        return;
+
+    /* The surface’s origin is the top left corner of the (unclipped) text. */
+    const int width = (ind->bullets - 1) * bullet.advance + bullet.width;
+    const int height = bullet.height;
+
+    /* Clear what is left over from the previous frame. */
+    cairo_t *ctx = indicator_ctx;
+    cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
+    cairo_rectangle(ctx, 0, 0, width, height);
+    cairo_fill(ctx);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_OVER);
+
+    for (int i = 0; i < ind->bullets; i++) {
+        if (i == ind->highlight)
+            cairo_set_source_rgb(ctx, ind->highlight_red, ind->highlight_green, ind->highlight_blue);
+        else
+            cairo_set_source_rgb(ctx, ind->red, ind->green, ind->blue);
+        cairo_mask_surface(ctx, bullet.mask, i * bullet.advance, 0);
+    }
+    cairo_surface_flush(indicator_surface);
+
+    for (int i = 0; i < ind->count; i++) {
+        const Rect box = ind->at[i].box;
+        cairo_set_source_surface(xcb_ctx, indicator_surface, ind->at[i].x + bullet.x, ind->at[i].y + bullet.y);
+        cairo_rectangle(xcb_ctx, box.x, box.y, box.width, box.height);
+        cairo_fill(xcb_ctx);
+    }
+}
+
+/*
+ * Draws the unlock indicator onto the given picture with Render: the bullet
+ * glyph is uploaded once, then each frame only sends its positions and color.
+ *
+ */
+static void draw_indicator_xrender(xcb_render_picture_t picture, const indicator_t *ind) {
+    if (ind->count == 0)
+        return;
+
+    if (!bullet.uploaded) {
+        xrender_set_glyph(cairo_image_surface_get_data(bullet.mask),
+                          cairo_image_surface_get_stride(bullet.mask),
+                          bullet.width, bullet.height, bullet.x, bullet.y, bullet.advance);
+        bullet.uploaded = true;
+    }
+    /* The X server clips bullets which are cut off by the screen edge. A
+     * highlighted bullet splits the text into three runs. */
+    for (int i = 0; i < ind->count; i++) {
+        const int x = ind->at[i].x, y = ind->at[i].y;
+        if (ind->highlight < 0) {
+            xrender_draw_glyphs(picture, ind->bullets, x, y, ind->red, ind->green, ind->blue);
+            continue;
+        }
+        const int h = ind->highlight;
+        if (h > 0)
+            xrender_draw_glyphs(picture, h, x, y, ind->red, ind->green, ind->blue);
+        xrender_draw_glyphs(picture, 1, x + h * bullet.advance, y,
+                            ind->highlight_red, ind->highlight_green, ind->highlight_blue);
+        if (h + 1 < ind->bullets)
+            xrender_draw_glyphs(picture, ind->bullets - h - 1, x + (h + 1) * bullet.advance, y,
+                                ind->red, ind->green, ind->blue);
+    }
+}
+
+/*
+ * Draws global image with fill color onto a pixmap with the given
+ * resolution and returns it.
+ *
+ */
+void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
+    TRACE_BEGIN(start);
+    const render_state_t *state = get_render_state(resolution);
+    draw_background(bg_pixmap, state);
+
+    indicator_t ind;
+    layout_indicator(state, &ind);
+    if (ind.count > 0) {
+        cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
+        cairo_t *xcb_ctx = cairo_create(xcb_output);
+        draw_indicator(xcb_ctx, &ind);
+        cairo_surface_destroy(xcb_output);
+        cairo_destroy(xcb_ctx);
+    }
+    TRACE_END(start, "draw_image");
+}
+
+/* The static part of the screen (background color and image), rendered once
+ * per layout. Every frame starts out as a copy of this layer. With -t, there is
+ * no layer: frames are filled with tile_pixmap instead. */
+static xcb_pixmap_t bg_layer = XCB_NONE;
+static bool bg_layer_valid = false;
+
+/* What a background layer depends on. */
+typedef struct {
+    uint32_t resolution[2];
+    /* Hash of the monitor layout (xr_resolutions). */
+    uint64_t layout;
+    long dpi;
+} bg_key_t;
+
+/* The key of bg_layer. */
+static bg_key_t bg_key;
+
+/* Recently used background layers, so that returning to a known layout (e.g.
+ * when undocking and docking a laptop again) does not need to render the
+ * background again. bg_layer is one of them. */
+#define BG_CACHE_SIZE 3
+
+static struct {
+    /* XCB_NONE if the entry is unused. */
+    xcb_pixmap_t pixmap;
+    bg_key_t key;
+    uint64_t last_used;
+} bg_cache[BG_CACHE_SIZE];
+static uint64_t bg_cache_clock = 0;
+
+/* A pixmap which frames are rendered into: bg_layer plus the unlock
+ * indicator. */
+typedef struct {
+    xcb_pixmap_t pixmap;
+    /* Cairo surface and context for drawing on the pixmap, or a Render
+     * picture with --xrender. */
+    cairo_surface_t *output;
+    cairo_t *ctx;
+    xcb_render_picture_t picture;
+    /* The areas covered by the unlock indicator in the current contents of
+     * the pixmap, which need to be restored from bg_layer for the next
+     * frame. */
+    Rect indicator_boxes[MAX_MONITORS];
+    int num_boxes;
+    /* Whether the X server is done using the pixmap (Present only). */
+    bool idle;
+} frame_buffer_t;
+
+/* Without Present, frames are rendered into a single buffer, which is the
+ * window’s background pixmap. With Present, the buffers take turns: one is
+ * being displayed while the next frame is rendered into the other one. */
+static frame_buffer_t buffers[2];
+static int num_buffers = 0;
+static int back_buffer = 0;
+
+/* Set when a frame could not be rendered because no buffer was idle. */
+static bool frame_deferred = false;
+
+/* Graphics context used to copy from bg_layer to the frame buffers. */
+static xcb_gcontext_t copy_gc = XCB_NONE;
+
+/* The resolution the frame buffers were allocated for. */
+static uint32_t buffer_resolution[2];
+
+/* The layout of the last frame which was rendered. A frame which would look
+ * the same is not rendered again. */
+static indicator_t last_frame;
+static bool last_frame_valid = false;
+
+/*
+ * Computes the key for a background layer in the current layout.
+ *
+ */
+static void current_bg_key(const render_state_t *state, bg_key_t *key) {
+    memset(key, 0, sizeof(bg_key_t));
+    key->resolution[0] = state->resolution[0];
+    key->resolution[1] = state->resolution[1];
+    key->layout = state->layout;
+    key->dpi = state->dpi;
+}
+
+/*
+ * Returns a background layer for the given key, from the cache if possible.
+ * Otherwise, the least recently used layer is replaced.
+ *
+ */
+static xcb_pixmap_t acquire_bg_layer(const render_state_t *state, const bg_key_t *key) {
+    int victim = 0;
+    for (int i = 0; i < BG_CACHE_SIZE; i++) {
+        if (bg_cache[i].pixmap != XCB_NONE &&
+            memcmp(&bg_cache[i].key, key, sizeof(bg_key_t)) == 0) {
+            DEBUG("reusing cached background for %d x %d px\n", key->resolution[0], key->resolution[1]);
+            bg_cache[i].last_used = ++bg_cache_clock;
+            return bg_cache[i].pixmap;
+        }
+        if (bg_cache[i].last_used < bg_cache[victim].last_used)
+            victim = i;
+    }
+
+    if (bg_cache[victim].pixmap != XCB_NONE)
+        xcb_free_pixmap(conn, bg_cache[victim].pixmap);
+
+    DEBUG("rendering background for %d x %d px\n", key->resolution[0], key->resolution[1]);
+    uint32_t resolution[2] = {key->resolution[0], key->resolution[1]};
+    xcb_pixmap_t pixmap = create_bg_pixmap(conn, screen, resolution, NULL);
+    draw_background(pixmap, state);
+    /* A pixmap of root depth, which we count as 32 bpp. */
+    count_alloc((size_t)resolution[0] * resolution[1] * 4);
+
+    bg_cache[victim].pixmap = pixmap;
+    bg_cache[victim].key = *key;
+    bg_cache[victim].last_used = ++bg_cache_clock;
+    return pixmap;
+}
+
+/*
+ * Releases the frame buffers, but keeps the cached background layers.
+ *
+ */
+static void free_frame_buffers(void) {
+    for (int i = 0; i < num_buffers; i++) {
+        if (buffers[i].picture != XCB_NONE) {
+            xrender_free_picture(buffers[i].picture);
+        } else {
+            cairo_destroy(buffers[i].ctx);
+            cairo_surface_destroy(buffers[i].output);
+        }
+        xcb_free_pixmap(conn, buffers[i].pixmap);
+    }
+    num_buffers = 0;
+    if (copy_gc != XCB_NONE)
+        xcb_free_gc(conn, copy_gc);
+    copy_gc = XCB_NONE;
+    last_frame_valid = false;
+}
+
+/*
+ * Releases the current background pixmap (and all cached ones) so that the
+ * next redraw_screen() call will render the background again, e.g. with a new
+ * image or resolution.
  *
  */
 void free_bg_pixmap(void) {
-    xcb_free_pixmap(conn, bg_pixmap);
-    bg_pixmap = XCB_NONE;
+    free_frame_buffers();
+    for (int i = 0; i < BG_CACHE_SIZE; i++) {
+        if (bg_cache[i].pixmap != XCB_NONE)
+            xcb_free_pixmap(conn, bg_cache[i].pixmap);
+        bg_cache[i].pixmap = XCB_NONE;
+        bg_cache[i].last_used = 0;
+    }
+    bg_layer = XCB_NONE;
+    bg_layer_valid = false;
+    free_tile_pixmap();
 }
 
 /*
- * Calls draw_image on a new pixmap and swaps that with the current pixmap
+ * Allocates the frame buffers for the current resolution.
  *
  */
-void redraw_screen(void) {
-    DEBUG("redraw_screen(unlock_state = %d, auth_state = %d)\n", unlock_state, auth_state);
-    if (bg_pixmap == XCB_NONE) {
-        DEBUG("allocating pixmap for %d x %d px\n", last_resolution[0], last_resolution[1]);
-        bg_pixmap = create_bg_pixmap(conn, screen, last_resolution, color);
+static void alloc_frame_buffers(void) {
+    DEBUG("allocating pixmaps for %d x %d px\n", last_resolution[0], last_resolution[1]);
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    num_buffers = (present_enabled() ? 2 : 1);
+    for (int i = 0; i < num_buffers; i++) {
+        buffers[i].pixmap = create_bg_pixmap(conn, screen, last_resolution, NULL);
+        if (xrender_enabled()) {
+            buffers[i].picture = xrender_create_picture(buffers[i].pixmap);
+            buffers[i].output = NULL;
+            buffers[i].ctx = NULL;
+        } else {
+            buffers[i].picture = XCB_NONE;
+            buffers[i].output = cairo_xcb_surface_create(conn, buffers[i].pixmap, vistype, last_resolution[0], last_resolution[1]);
+            buffers[i].ctx = cairo_create(buffers[i].output);
+        }
+        buffers[i].idle = true;
+    }
+    back_buffer = 0;
+
+    copy_gc = xcb_generate_id(conn);
+    xcb_create_gc(conn, copy_gc, buffers[0].pixmap, 0, NULL);
+
+    /* Pixmaps of root depth, which we count as 32 bpp. */
+    count_alloc(num_buffers * (size_t)last_resolution[0] * last_resolution[1] * 4);
+    buffer_resolution[0] = last_resolution[0];
+    buffer_resolution[1] = last_resolution[1];
+}
+
+/*
+ * Switches to the background layer for the current layout. The next frame in
+ * each buffer copies the entire layer.
+ *
+ */
+static void update_bg_layer(const render_state_t *state, const bg_key_t *key) {
+    bg_layer = (ensure_tile_pixmap(state) ? XCB_NONE : acquire_bg_layer(state, key));
+    bg_key = *key;
+    bg_layer_valid = true;
+
+    for (int i = 0; i < num_buffers; i++) {
+        buffers[i].indicator_boxes[0] = (Rect){0, 0, last_resolution[0], last_resolution[1]};
+        buffers[i].num_boxes = 1;
+    }
+
+    if (present_enabled()) {
+        /* Exposed areas are filled with the (static) background until the
+         * next frame is presented. The X server tiles a window’s background
+         * pixmap across the window. */
+        const xcb_pixmap_t background = (bg_layer != XCB_NONE ? bg_layer : tile_pixmap);
+        xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){background});
+    }
+}
+
+/*
+ * Called when the X server no longer uses the given pixmap for displaying a
+ * frame presented earlier.
+ *
+ */
+void frame_buffer_idle(xcb_pixmap_t pixmap) {
+    for (int i = 0; i < num_buffers; i++) {
+        if (buffers[i].pixmap == pixmap)
+            buffers[i].idle = true;
+    }
+
+    if (frame_deferred) {
+        frame_deferred = false;
+        redraw_screen();
+    }
+}
+
+/*
+ * Renders the current state into the next frame buffer and displays it,
+ * unless it looks exactly like the last frame.
+ *
+ * The background is only rendered when the resolution changes. Afterwards,
+ * only the area covered by the unlock indicator (in the previous and in the
+ * current frame) is restored from the background layer and redrawn.
+ *
+ * Without Present, the frame buffer is the window’s background pixmap and
+ * only the changed area of the window is cleared. With Present, the finished
+ * buffer is presented and the next frame uses the other buffer.
+ *
+ */
+static void render_frame(void) {
+    DEBUG("render_frame(unlock_state = %d, auth_state = %d)\n", unlock_state, auth_state);
+    TRACE_BEGIN(start);
+
+    if (num_buffers > 0 &&
+        (buffer_resolution[0] != last_resolution[0] ||
+         buffer_resolution[1] != last_resolution[1])) {
+        DEBUG("resolution changed, freeing pixmaps\n");
+        free_frame_buffers();
+    }
+
+    const bool new_buffers = (num_buffers == 0);
+    if (new_buffers)
+        alloc_frame_buffers();
+
+    const render_state_t *state = get_render_state(last_resolution);
+    bg_key_t key;
+    current_bg_key(state, &key);
+    const bool full_redraw = (new_buffers || !bg_layer_valid ||
+                              memcmp(&key, &bg_key, sizeof(bg_key_t)) != 0);
+    if (full_redraw)
+        update_bg_layer(state, &key);
+
+    indicator_t ind;
+    layout_indicator(state, &ind);
+    update_animation_timer();
+    if (!full_redraw && last_frame_valid && memcmp(&ind, &last_frame, sizeof(indicator_t)) == 0) {
+        DEBUG("frame unchanged, skipping\n");
+        /* Span arguments are numbers, so the reason is the argument's name. */
+        TRACE_END_ARG(start, "render_frame", "skipped", 1);
+        return;
+    }
+
+    frame_buffer_t *buffer = &buffers[back_buffer];
+    if (!buffer->idle) {
+        /* Do not draw into a pixmap the X server might still scan out. */
+        DEBUG("no idle frame buffer, deferring the redraw\n");
+        frame_deferred = true;
+        TRACE_END_ARG(start, "render_frame", "deferred", 1);
+        return;
+    }
+
+    /* Restore the background where the indicators were displayed before,
+     * then draw them in their current state. Placements are matched up by
+     * index, which keeps the damage of each monitor separate. */
+    Rect damage[MAX_MONITORS];
+    const int num_damage = (buffer->num_boxes > ind.count ? buffer->num_boxes : ind.count);
+    for (int i = 0; i < num_damage; i++) {
+        damage[i] = rect_union(i < buffer->num_boxes ? buffer->indicator_boxes[i] : (Rect){0, 0, 0, 0},
+                               i < ind.count ? ind.at[i].box : (Rect){0, 0, 0, 0});
+    }
+
+    /* cairo has to flush its own pending drawing operations before we copy
+     * behind its back. */
+    if (buffer->output)
+        cairo_surface_flush(buffer->output);
+    for (int i = 0; i < num_damage; i++) {
+        if (damage[i].width == 0)
+            continue;
+        if (bg_layer != XCB_NONE) {
+            xcb_copy_area(conn, bg_layer, buffer->pixmap, copy_gc,
+                          damage[i].x, damage[i].y, damage[i].x, damage[i].y,
+                          damage[i].width, damage[i].height);
+        } else {
+            xcb_poly_fill_rectangle(conn, buffer->pixmap, tile_gc, 1,
+                                    &(xcb_rectangle_t){damage[i].x, damage[i].y, damage[i].width, damage[i].height});
+        }
+        frame_painted_px += rect_area(damage[i]);
+        if (buffer->output)
+            cairo_surface_mark_dirty_rectangle(buffer->output, damage[i].x, damage[i].y,
+                                               damage[i].width, damage[i].height);
+    }
+    if (buffer->picture != XCB_NONE) {
+        /* Both requests are executed by the X server, in order. */
+        draw_indicator_xrender(buffer->picture, &ind);
+    } else if (ind.count > 0) {
+        draw_indicator(buffer->ctx, &ind);
+        cairo_surface_flush(buffer->output);
+    }
+    for (int i = 0; i < ind.count; i++) {
+        buffer->indicator_boxes[i] = ind.at[i].box;
+        frame_painted_px += rect_area(ind.at[i].box);
     }
+    buffer->num_boxes = ind.count;
+    last_frame = ind;
+    last_frame_valid = true;
 
-    draw_image(bg_pixmap, last_resolution);
-    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
-    /* XXX: Possible optimization: Only update the area in the middle of the
-     * screen instead of the whole screen. */
-    xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
+    if (present_enabled()) {
+        present_frame(buffer->pixmap);
+        buffer->idle = false;
+        back_buffer = (back_buffer + 1) % num_buffers;
+    } else {
+        if (new_buffers)
+            xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){buffer->pixmap});
+        for (int i = 0; i < num_damage; i++) {
+            if (damage[i].width > 0)
+                xcb_clear_area(conn, 0, win, damage[i].x, damage[i].y, damage[i].width, damage[i].height);
+        }
+    }
     xcb_flush(conn);
+
+    DEBUG("frame allocated %zu bytes (%zu bytes since startup), painted %" PRIu64 " px\n",
+          frame_alloc_bytes, total_alloc_bytes, frame_painted_px);
+    frame_alloc_bytes = 0;
+    frame_painted_px = 0;
+    TRACE_END_ARG(start, "render_frame", "full", full_redraw);
+}
+
+/* Frames are rendered at most once per event loop iteration: redraw_screen()
+ * only marks the screen as dirty, the frame is rendered right before the
+ * loop blocks again (or once min_frame_interval passed since the last
+ * frame). */
+static bool frame_dirty = false;
+static bool frame_watchers_initialized = false;
+static ev_prepare frame_prepare;
+static ev_timer frame_timer;
+static ev_tstamp last_frame_time = 0;
+
+/*
+ * Renders the frame if the screen is dirty.
+ *
+ */
+void render_pending_frame(void) {
+    if (!frame_dirty)
+        return;
+    frame_dirty = false;
+
+    if (frame_watchers_initialized) {
+        ev_prepare_stop(main_loop, &frame_prepare);
+        ev_timer_stop(main_loop, &frame_timer);
+        last_frame_time = ev_now(main_loop);
+    }
+    render_frame();
+}
+
+static void frame_timer_cb(EV_P_ ev_timer *w, int revents) {
+    render_pending_frame();
+}
+
+static void frame_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+    ev_prepare_stop(EV_A_ w);
+
+    const ev_tstamp next_frame = last_frame_time + min_frame_interval;
+    if (min_frame_interval > 0 && ev_now(EV_A) < next_frame) {
+        ev_timer_set(&frame_timer, next_frame - ev_now(EV_A), 0.);
+        ev_timer_start(EV_A_ &frame_timer);
+        return;
+    }
+    render_pending_frame();
+}
+
+/*
+ * Schedules a redraw of the screen. Any number of calls before the event
+ * loop blocks again result in a single frame.
+ *
+ */
+void redraw_screen(void) {
+    frame_dirty = true;
+
+    /* Without an event loop, there is nothing to coalesce with. */
+    if (main_loop == NULL) {
+        render_pending_frame();
+        return;
+    }
+
+    if (!frame_watchers_initialized) {
+        ev_prepare_init(&frame_prepare, frame_prepare_cb);
+        ev_init(&frame_timer, frame_timer_cb);
+        frame_watchers_initialized = true;
+    }
+
+    if (!ev_is_active(&frame_timer))
+        ev_prepare_start(main_loop, &frame_prepare);
+}
+
+/*
+ * Schedules a redraw which is not skipped even if nothing changed, e.g. when
+ * the window contents were lost.
+ *
+ */
+void invalidate_screen(void) {
+    last_frame_valid = false;
+    redraw_screen();
 }
 
 /*
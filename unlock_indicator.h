@@ -3,6 +3,10 @@
 
 #include <xcb/xcb.h>
 
+/* Value of show_on_screen (-s all) to display the unlock indicator on every
+ * monitor. */
+#define SHOW_ON_ALL_SCREENS -2
+
 typedef enum {
     STATE_STARTED = 0,           /* default state */
     STATE_KEY_PRESSED = 1,       /* key was pressed, show unlock indicator */
@@ -21,9 +25,14 @@ typedef enum {
     STATE_I3LOCK_LOCK_FAILED = 4, /* i3lock failed to load */
 } auth_state_t;
 
+void move_image_to_server(void);
 void free_bg_pixmap(void);
 void draw_image(xcb_pixmap_t bg_pixmap, uint32_t* resolution);
 void redraw_screen(void);
+void invalidate_screen(void);
+void invalidate_render_state(void);
+void render_pending_frame(void);
+void frame_buffer_idle(xcb_pixmap_t pixmap);
 void clear_indicator(void);
 
 #endif
@@ -11,6 +11,8 @@
 #include <xcb/xcb_image.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_aux.h>
+#include <xcb/shm.h>
+#include <ev.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -18,35 +20,70 @@
 #include <unistd.h>
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
+#include "i3lock.h"
+#include "xcb.h"
 #include "cursors.h"
 #include "unlock_indicator.h"
 
 extern auth_state_t auth_state;
+extern bool debug_mode;
+extern struct ev_loop *main_loop;
 
 xcb_connection_t *conn;
 xcb_screen_t *screen;
 
-static xcb_atom_t _NET_WM_BYPASS_COMPOSITOR = XCB_NONE;
-void _init_net_wm_bypass_compositor(xcb_connection_t *conn) {
-    if (_NET_WM_BYPASS_COMPOSITOR != XCB_NONE) {
-        /* already initialized */
+/* An atom which is interned on first use, or up front by prefetch_atoms(). */
+typedef struct {
+    const char *name;
+    xcb_atom_t atom;
+    xcb_intern_atom_cookie_t cookie;
+    bool pending;
+} lazy_atom_t;
+
+static lazy_atom_t _NET_WM_BYPASS_COMPOSITOR = {.name = "_NET_WM_BYPASS_COMPOSITOR", .atom = XCB_NONE};
+static lazy_atom_t _NET_ACTIVE_WINDOW = {.name = "_NET_ACTIVE_WINDOW", .atom = XCB_NONE};
+
+static void request_atom(xcb_connection_t *conn, lazy_atom_t *atom) {
+    if (atom->atom != XCB_NONE || atom->pending)
         return;
+    atom->cookie = xcb_intern_atom(conn, 0, strlen(atom->name), atom->name);
+    atom->pending = true;
+}
+
+static xcb_atom_t get_atom(xcb_connection_t *conn, lazy_atom_t *atom) {
+    if (atom->atom != XCB_NONE) {
+        /* already initialized */
+        return atom->atom;
     }
+    request_atom(conn, atom);
+    atom->pending = false;
+
     xcb_generic_error_t *err;
-    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(
-        conn,
-        xcb_intern_atom(conn, 0, strlen("_NET_WM_BYPASS_COMPOSITOR"), "_NET_WM_BYPASS_COMPOSITOR"),
-        &err);
+    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(conn, atom->cookie, &err);
     if (atom_reply == NULL) {
         fprintf(stderr, "X11 Error %d\n", err->error_code);
         free(err);
-        return;
+        return XCB_NONE;
     }
-    _NET_WM_BYPASS_COMPOSITOR = atom_reply->atom;
+    atom->atom = atom_reply->atom;
     free(atom_reply);
+    return atom->atom;
+}
+
+/*
+ * Sends the InternAtom requests for all atoms i3lock uses, so that their
+ * replies arrive while other startup work is going on.
+ *
+ */
+void prefetch_atoms(xcb_connection_t *conn) {
+    request_atom(conn, &_NET_WM_BYPASS_COMPOSITOR);
+    request_atom(conn, &_NET_ACTIVE_WINDOW);
 }
 
 #define curs_invisible_width 8
@@ -73,7 +110,17 @@ static unsigned char mask_windows_bits[] = {
     0xf7, 0x00, 0xf3, 0x00, 0xe1, 0x01, 0xe0, 0x01, 0xc0, 0x03, 0xc0, 0x03,
     0x80, 0x01};
 
+/*
+ * Returns the pixel value of the given color (rrggbb). The color does not
+ * change after startup, so the last result is kept.
+ *
+ */
 static uint32_t get_colorpixel(char *hex) {
+    static char last_hex[7];
+    static uint32_t last_pixel;
+    if (strncmp(hex, last_hex, 6) == 0)
+        return last_pixel;
+
     char strgroups[3][3] = {{hex[0], hex[1], '\0'},
                             {hex[2], hex[3], '\0'},
                             {hex[4], hex[5], '\0'}};
@@ -81,7 +128,9 @@ static uint32_t get_colorpixel(char *hex) {
                          (strtol(strgroups[1], NULL, 16)),
                          (strtol(strgroups[2], NULL, 16))};
 
-    return (rgb16[0] << 16) + (rgb16[1] << 8) + rgb16[2];
+    last_pixel = (rgb16[0] << 16) + (rgb16[1] << 8) + rgb16[2];
+    memcpy(last_hex, hex, 6);
+    return last_pixel;
 }
 
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *screen) {
@@ -111,6 +160,11 @@ xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32
     xcb_create_pixmap(conn, scr->root_depth, bg_pixmap, scr->root,
                       resolution[0], resolution[1]);
 
+    /* Without a color, the contents are left undefined for the caller to
+     * paint over. */
+    if (color == NULL)
+        return bg_pixmap;
+
     /* Generate a Graphics Context and fill the pixmap with background color
      * (for images that are smaller than your screen) */
     xcb_gcontext_t gc = xcb_generate_id(conn);
@@ -123,7 +177,167 @@ xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32
     return bg_pixmap;
 }
 
-xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
+/*
+ * Returns whether the X server stores pixels of root depth in the same layout
+ * as cairo’s CAIRO_FORMAT_RGB24: 32 bits per pixel, native endianness,
+ * 0x00RRGGBB. Images in this layout can be transferred as-is.
+ *
+ */
+bool root_format_is_rgb24(xcb_connection_t *conn, xcb_screen_t *scr) {
+    const xcb_setup_t *setup = xcb_get_setup(conn);
+    const uint16_t endian_test = 1;
+    const uint8_t native_order = (*(const uint8_t *)&endian_test == 1 ? XCB_IMAGE_ORDER_LSB_FIRST : XCB_IMAGE_ORDER_MSB_FIRST);
+    bool format_ok = false;
+    for (xcb_format_iterator_t iter = xcb_setup_pixmap_formats_iterator(setup);
+         iter.rem;
+         xcb_format_next(&iter)) {
+        if (iter.data->depth == scr->root_depth && iter.data->bits_per_pixel == 32)
+            format_ok = true;
+    }
+    xcb_visualtype_t *visual = get_root_visual_type(scr);
+    return (format_ok && setup->image_byte_order == native_order && scr->root_depth == 24 && visual != NULL &&
+            visual->red_mask == 0xff0000 && visual->green_mask == 0xff00 && visual->blue_mask == 0xff);
+}
+
+/* Set once attaching a shared memory segment failed (e.g. because the X
+ * server runs on a different machine), so that we do not try again. */
+static bool shm_unusable = false;
+
+/*
+ * Creates an image in a shared memory segment which is attached to the X
+ * server, so that it can be uploaded without copying it over the X11 socket.
+ * The pixels are stored in cairo’s CAIRO_FORMAT_RGB24 layout.
+ *
+ * Returns NULL if MIT-SHM is not available or the root window’s pixel format
+ * does not match, in which case the image needs to be uploaded differently.
+ * Unless read_only is set, the X server may also write into the image.
+ *
+ */
+static shm_image_t *shm_image_alloc(xcb_connection_t *conn, xcb_screen_t *scr, uint16_t width, uint16_t height, bool read_only) {
+    if (shm_unusable)
+        return NULL;
+
+    const xcb_query_extension_reply_t *extreply = xcb_get_extension_data(conn, &xcb_shm_id);
+    if (extreply == NULL || !extreply->present) {
+        DEBUG("MIT-SHM is not available\n");
+        shm_unusable = true;
+        return NULL;
+    }
+
+    /* The image is uploaded as-is. */
+    if (!root_format_is_rgb24(conn, scr)) {
+        DEBUG("Root window pixel format does not match, not using MIT-SHM\n");
+        shm_unusable = true;
+        return NULL;
+    }
+
+    shm_image_t *image = calloc(1, sizeof(shm_image_t));
+    if (image == NULL)
+        return NULL;
+    image->width = width;
+    image->height = height;
+    image->stride = width * 4;
+
+    image->shmid = shmget(IPC_PRIVATE, (size_t)image->stride * height, IPC_CREAT | 0600);
+    if (image->shmid == -1) {
+        DEBUG("shmget() failed: %s\n", strerror(errno));
+        free(image);
+        return NULL;
+    }
+
+    image->data = shmat(image->shmid, NULL, 0);
+    if (image->data == (void *)-1) {
+        DEBUG("shmat() failed: %s\n", strerror(errno));
+        shmctl(image->shmid, IPC_RMID, NULL);
+        free(image);
+        return NULL;
+    }
+
+    image->shmseg = xcb_generate_id(conn);
+    xcb_generic_error_t *err = xcb_request_check(conn, xcb_shm_attach_checked(conn, image->shmseg, image->shmid, read_only));
+
+    /* The segment is destroyed as soon as both we and the X server detach. */
+    shmctl(image->shmid, IPC_RMID, NULL);
+
+    if (err != NULL) {
+        /* Most likely, this is a remote display. */
+        DEBUG("Could not attach shared memory segment: X11 error code %d, not using MIT-SHM\n", err->error_code);
+        free(err);
+        shm_unusable = true;
+        shmdt(image->data);
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+shm_image_t *shm_image_create(xcb_connection_t *conn, xcb_screen_t *scr, uint16_t width, uint16_t height) {
+    return shm_image_alloc(conn, scr, width, height, true);
+}
+
+/*
+ * Reads the contents of the given drawable into a new shared memory image,
+ * without copying them over the X11 socket. Returns NULL if MIT-SHM cannot be
+ * used (see shm_image_create()).
+ *
+ */
+shm_image_t *shm_image_get(xcb_connection_t *conn, xcb_screen_t *scr, xcb_drawable_t drawable, uint16_t width, uint16_t height) {
+    shm_image_t *image = shm_image_alloc(conn, scr, width, height, false);
+    if (image == NULL)
+        return NULL;
+
+    xcb_generic_error_t *err = NULL;
+    xcb_shm_get_image_reply_t *reply = xcb_shm_get_image_reply(
+        conn,
+        xcb_shm_get_image(conn, drawable, 0, 0, width, height, ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, image->shmseg, 0),
+        &err);
+    if (reply == NULL) {
+        DEBUG("Could not read the drawable via MIT-SHM: X11 error code %d\n", (err ? err->error_code : 0));
+        free(err);
+        shm_image_destroy(conn, image);
+        return NULL;
+    }
+    free(reply);
+    return image;
+}
+
+/*
+ * Copies the entire shared memory image onto the given drawable, with its top
+ * left corner at (x, y).
+ *
+ */
+void shm_image_put(xcb_connection_t *conn, xcb_screen_t *scr, shm_image_t *image, xcb_drawable_t drawable, int16_t x, int16_t y) {
+    xcb_gcontext_t gc = xcb_generate_id(conn);
+    xcb_create_gc(conn, gc, drawable, 0, NULL);
+    xcb_shm_put_image(conn, drawable, gc,
+                      image->width, image->height, /* total size */
+                      0, 0, image->width, image->height,
+                      x, y, /* destination */
+                      scr->root_depth,
+                      XCB_IMAGE_FORMAT_Z_PIXMAP,
+                      false, /* send_event */
+                      image->shmseg, 0);
+    xcb_free_gc(conn, gc);
+}
+
+/*
+ * Detaches and frees the shared memory image. The X server processes the
+ * detach request after all requests using the segment which were sent before,
+ * so this does not require a round trip.
+ *
+ */
+void shm_image_destroy(xcb_connection_t *conn, shm_image_t *image) {
+    xcb_shm_detach(conn, image->shmseg);
+    shmdt(image->data);
+    free(image);
+}
+
+/*
+ * Creates the (still unmapped) window which covers the screen.
+ *
+ */
+xcb_window_t create_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
     uint32_t mask = 0;
     uint32_t values[3];
     xcb_window_t win = xcb_generate_id(conn);
@@ -179,16 +393,25 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
                         "i3lock\0i3lock\0");
 
     const uint32_t bypass_compositor = 1; /* disable compositing */
-    _init_net_wm_bypass_compositor(conn);
     xcb_change_property(conn,
                         XCB_PROP_MODE_REPLACE,
                         win,
-                        _NET_WM_BYPASS_COMPOSITOR,
+                        get_atom(conn, &_NET_WM_BYPASS_COMPOSITOR),
                         XCB_ATOM_CARDINAL,
                         32,
                         1,
                         &bypass_compositor);
 
+    return win;
+}
+
+/*
+ * Maps the window on top of all other windows.
+ *
+ */
+void map_fullscreen_window(xcb_connection_t *conn, xcb_window_t win) {
+    uint32_t values[1];
+
     /* Map the window (= make it visible) */
     xcb_map_window(conn, win);
 
@@ -196,114 +419,152 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
     values[0] = XCB_STACK_MODE_ABOVE;
     xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
 
-    /* Ensure that the window is created and set up before returning */
-    xcb_aux_sync(conn);
+    /* Send the requests right away. There is no need to wait for them to
+     * be processed: the server handles the grabs (and anything else) which
+     * follow in order. */
+    xcb_flush(conn);
+}
 
+xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
+    xcb_window_t win = create_fullscreen_window(conn, scr, color, pixmap);
+    map_fullscreen_window(conn, win);
     return win;
 }
 
+/* The first retry happens after GRAB_MIN_DELAY seconds, each further retry
+ * waits twice as long as the one before, up to GRAB_MAX_DELAY. */
+#define GRAB_MIN_DELAY 0.001
+#define GRAB_MAX_DELAY 0.05
+
+/* After this many seconds without a grab, the "locking…" indicator is shown. */
+#define GRAB_REDRAW_DELAY 0.1
+
+static struct {
+    xcb_connection_t *conn;
+    xcb_screen_t *screen;
+    xcb_cursor_t cursor;
+    bool pointer_grabbed;
+    bool keyboard_grabbed;
+    int attempts;
+    ev_tstamp delay;
+    ev_tstamp deadline;
+    ev_timer attempt_timer;
+    ev_timer redraw_timer;
+    bool redrawn;
+    /* A loop of its own, see grab_pointer_and_keyboard(). */
+    struct ev_loop *loop;
+} grab;
+
+static void grab_done(EV_P) {
+    ev_timer_stop(EV_A_ &grab.attempt_timer);
+    ev_timer_stop(EV_A_ &grab.redraw_timer);
+    ev_break(EV_A_ EVBREAK_ONE);
+}
+
 /*
- * Repeatedly tries to grab pointer and keyboard (up to the specified number of
- * tries).
- *
- * Returns true if the grab succeeded, false if not.
+ * Sends the grab requests for whatever is not grabbed yet (both together, so
+ * that they share a round trip), and schedules the next attempt if needed.
  *
  */
-bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int tries) {
+static void grab_attempt_cb(EV_P_ ev_timer *w, int revents) {
     xcb_grab_pointer_cookie_t pcookie;
-    xcb_grab_pointer_reply_t *preply;
-
     xcb_grab_keyboard_cookie_t kcookie;
-    xcb_grab_keyboard_reply_t *kreply;
-
-    const suseconds_t screen_redraw_timeout = 100000; /* 100ms */
-
-    /* Using few variables to trigger a redraw_screen() if too many tries */
-    bool redrawn = false;
-    struct timeval start;
-    if (gettimeofday(&start, NULL) == -1) {
-        err(EXIT_FAILURE, "gettimeofday");
-    }
 
-    while (tries-- > 0) {
+    if (!grab.pointer_grabbed) {
         pcookie = xcb_grab_pointer(
-            conn,
+            grab.conn,
             false,               /* get all pointer events specified by the following mask */
-            screen->root,        /* grab the root window */
+            grab.screen->root,   /* grab the root window */
             XCB_NONE,            /* which events to let through */
             XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
             XCB_GRAB_MODE_ASYNC, /* keyboard mode */
             XCB_NONE,            /* confine_to = in which window should the cursor stay */
-            cursor,              /* we change the cursor to whatever the user wanted */
+            grab.cursor,         /* we change the cursor to whatever the user wanted */
             XCB_CURRENT_TIME);
-
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
-            preply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(preply);
-            break;
-        }
-
-        /* In case the grab failed, we still need to free the reply */
-        free(preply);
-
-        /* Make this quite a bit slower */
-        usleep(50);
-
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == -1) {
-            err(EXIT_FAILURE, "gettimeofday");
-        }
-
-        struct timeval elapsed;
-        timersub(&now, &start, &elapsed);
-
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            elapsed.tv_usec >= screen_redraw_timeout) {
-            redraw_screen();
-            redrawn = true;
-        }
     }
 
-    while (tries-- > 0) {
+    if (!grab.keyboard_grabbed) {
         kcookie = xcb_grab_keyboard(
-            conn,
-            true,         /* report events */
-            screen->root, /* grab the root window */
+            grab.conn,
+            true,              /* report events */
+            grab.screen->root, /* grab the root window */
             XCB_CURRENT_TIME,
             XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
             XCB_GRAB_MODE_ASYNC);
+    }
 
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
-            kreply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(kreply);
-            break;
-        }
+    grab.attempts++;
 
-        /* In case the grab failed, we still need to free the reply */
-        free(kreply);
+    if (!grab.pointer_grabbed) {
+        xcb_grab_pointer_reply_t *preply = xcb_grab_pointer_reply(grab.conn, pcookie, NULL);
+        grab.pointer_grabbed = (preply != NULL && preply->status == XCB_GRAB_STATUS_SUCCESS);
+        free(preply);
+    }
 
-        /* Make this quite a bit slower */
-        usleep(50);
+    if (!grab.keyboard_grabbed) {
+        xcb_grab_keyboard_reply_t *kreply = xcb_grab_keyboard_reply(grab.conn, kcookie, NULL);
+        grab.keyboard_grabbed = (kreply != NULL && kreply->status == XCB_GRAB_STATUS_SUCCESS);
+        free(kreply);
+    }
 
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == -1) {
-            err(EXIT_FAILURE, "gettimeofday");
-        }
+    if ((grab.pointer_grabbed && grab.keyboard_grabbed) ||
+        ev_now(EV_A) >= grab.deadline) {
+        grab_done(EV_A);
+        return;
+    }
 
-        struct timeval elapsed;
-        timersub(&now, &start, &elapsed);
+    ev_timer_set(w, grab.delay, 0.);
+    ev_timer_start(EV_A_ w);
+    grab.delay = (grab.delay * 2 > GRAB_MAX_DELAY ? GRAB_MAX_DELAY : grab.delay * 2);
+}
 
-        /* Trigger a screen redraw if 100ms elapsed */
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            elapsed.tv_usec >= screen_redraw_timeout) {
-            redraw_screen();
-            redrawn = true;
-        }
-    }
+static void grab_redraw_cb(EV_P_ ev_timer *w, int revents) {
+    grab.redrawn = true;
+    /* The main loop, which would render the frame, is not running. */
+    redraw_screen();
+    render_pending_frame();
+}
 
-    return (tries > 0);
+/*
+ * Tries to grab pointer and keyboard until both are grabbed or the timeout
+ * (in seconds) expires, retrying with exponential backoff. The grab timers
+ * run on a dedicated event loop instead of main_loop: with --daemon, the
+ * screen is locked from a callback of main_loop, whose other watchers (X11
+ * events, the socket, signals, authentication) must not be dispatched in the
+ * middle of locking. X11 events are left for the main loop.
+ *
+ * Returns true if the grab succeeded, false if not.
+ *
+ */
+bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, double timeout) {
+    if (grab.loop == NULL && (grab.loop = ev_loop_new(EVFLAG_AUTO)) == NULL)
+        errx(EXIT_FAILURE, "Could not create an event loop for grabbing");
+    ev_now_update(grab.loop);
+    const ev_tstamp start = ev_now(grab.loop);
+    const int attempts = grab.attempts;
+
+    grab.conn = conn;
+    grab.screen = screen;
+    grab.cursor = cursor;
+    grab.delay = GRAB_MIN_DELAY;
+    grab.deadline = start + timeout;
+
+    ev_timer_init(&grab.attempt_timer, grab_attempt_cb, 0., 0.);
+    ev_timer_start(grab.loop, &grab.attempt_timer);
+
+    /* Only redraw once, even if called again after stealing the focus. */
+    ev_timer_init(&grab.redraw_timer, grab_redraw_cb, GRAB_REDRAW_DELAY, 0.);
+    if (!grab.redrawn)
+        ev_timer_start(grab.loop, &grab.redraw_timer);
+
+    ev_run(grab.loop, 0);
+
+    ev_now_update(grab.loop);
+    const bool grabbed = (grab.pointer_grabbed && grab.keyboard_grabbed);
+    DEBUG("%s pointer and keyboard after %.3f ms (%d attempts)\n",
+          (grabbed ? "grabbed" : "could not grab"),
+          (ev_now(grab.loop) - start) * 1000.0, grab.attempts - attempts);
+    return grabbed;
 }
 
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice) {
@@ -369,36 +630,21 @@ xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_win
     return cursor;
 }
 
-static xcb_atom_t _NET_ACTIVE_WINDOW = XCB_NONE;
-void _init_net_active_window(xcb_connection_t *conn) {
-    if (_NET_ACTIVE_WINDOW != XCB_NONE) {
-        /* already initialized */
-        return;
-    }
-    xcb_generic_error_t *err;
-    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(
-        conn,
-        xcb_intern_atom(conn, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW"),
-        &err);
-    if (atom_reply == NULL) {
-        fprintf(stderr, "X11 Error %d\n", err->error_code);
-        free(err);
-        return;
-    }
-    _NET_ACTIVE_WINDOW = atom_reply->atom;
-    free(atom_reply);
+/*
+ * Requests the _NET_ACTIVE_WINDOW property of the root window. The reply is
+ * collected by find_focused_window(), so that the request can be sent before
+ * i3lock’s window is mapped and the reply read after.
+ *
+ */
+xcb_get_property_cookie_t request_focused_window(xcb_connection_t *conn, const xcb_window_t root) {
+    return xcb_get_property_unchecked(
+        conn, false, root, get_atom(conn, &_NET_ACTIVE_WINDOW), XCB_GET_PROPERTY_TYPE_ANY, 0, 1 /* word */);
 }
 
-xcb_window_t find_focused_window(xcb_connection_t *conn, const xcb_window_t root) {
+xcb_window_t find_focused_window(xcb_connection_t *conn, xcb_get_property_cookie_t cookie) {
     xcb_window_t result = XCB_NONE;
 
-    _init_net_active_window(conn);
-
-    xcb_get_property_reply_t *prop_reply = xcb_get_property_reply(
-        conn,
-        xcb_get_property_unchecked(
-            conn, false, root, _NET_ACTIVE_WINDOW, XCB_GET_PROPERTY_TYPE_ANY, 0, 1 /* word */),
-        NULL);
+    xcb_get_property_reply_t *prop_reply = xcb_get_property_reply(conn, cookie, NULL);
     if (prop_reply == NULL) {
         goto out;
     }
@@ -421,11 +667,9 @@ void set_focused_window(xcb_connection_t *conn, const xcb_window_t root, const x
     xcb_client_message_event_t ev;
     memset(&ev, '\0', sizeof(xcb_client_message_event_t));
 
-    _init_net_active_window(conn);
-
     ev.response_type = XCB_CLIENT_MESSAGE;
     ev.window = window;
-    ev.type = _NET_ACTIVE_WINDOW;
+    ev.type = get_atom(conn, &_NET_ACTIVE_WINDOW);
     ev.format = 32;
     ev.data.data32[0] = 2; /* 2 = pager */
 
@@ -1,17 +1,38 @@
 #ifndef _XCB_H
 #define _XCB_H
 
+#include <stdbool.h>
 #include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+/* An image in a shared memory segment attached to the X server (MIT-SHM). */
+typedef struct {
+    xcb_shm_seg_t shmseg;
+    int shmid;
+    uint8_t *data;
+    uint32_t stride;
+    uint16_t width;
+    uint16_t height;
+} shm_image_t;
 
 extern xcb_connection_t *conn;
 extern xcb_screen_t *screen;
 
+void prefetch_atoms(xcb_connection_t *conn);
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *s);
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color);
+bool root_format_is_rgb24(xcb_connection_t *conn, xcb_screen_t *scr);
+shm_image_t *shm_image_create(xcb_connection_t *conn, xcb_screen_t *scr, uint16_t width, uint16_t height);
+shm_image_t *shm_image_get(xcb_connection_t *conn, xcb_screen_t *scr, xcb_drawable_t drawable, uint16_t width, uint16_t height);
+void shm_image_put(xcb_connection_t *conn, xcb_screen_t *scr, shm_image_t *image, xcb_drawable_t drawable, int16_t x, int16_t y);
+void shm_image_destroy(xcb_connection_t *conn, shm_image_t *image);
+xcb_window_t create_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
+void map_fullscreen_window(xcb_connection_t *conn, xcb_window_t win);
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
-bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int tries);
+bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, double timeout);
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice);
-xcb_window_t find_focused_window(xcb_connection_t *conn, const xcb_window_t root);
+xcb_get_property_cookie_t request_focused_window(xcb_connection_t *conn, const xcb_window_t root);
+xcb_window_t find_focused_window(xcb_connection_t *conn, xcb_get_property_cookie_t cookie);
 void set_focused_window(xcb_connection_t *conn, const xcb_window_t root, const xcb_window_t window);
 
 #endif
@@ -0,0 +1,200 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * xrender.c: draws the unlock indicator with the X Render extension
+ *            (--xrender). The bullet is uploaded once as a glyph, so each
+ *            frame is a CompositeGlyphs request of a few bytes instead of
+ *            pixels rendered by cairo and uploaded to the X server.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+#include <xcb/render.h>
+
+#include "i3lock.h"
+#include "xrender.h"
+
+extern bool debug_mode;
+
+static bool xrender_active = false;
+static xcb_connection_t *xrender_conn;
+
+/* The format of pictures for root depth pixmaps, and the 8 bit alpha format
+ * of the glyphs. */
+static xcb_render_pictformat_t visual_format;
+static xcb_render_pictformat_t a8_format;
+
+static xcb_render_glyphset_t glyphset = XCB_NONE;
+
+/* A picture of a single color, which the glyphs are painted with. It is only
+ * created again when the color changes. */
+static xcb_render_picture_t fill = XCB_NONE;
+static xcb_render_color_t fill_color;
+
+/*
+ * Finds the picture format of the given visual.
+ *
+ */
+static xcb_render_pictformat_t find_visual_format(const xcb_render_query_pict_formats_reply_t *formats, xcb_visualid_t visual) {
+    xcb_render_pictscreen_iterator_t screens = xcb_render_query_pict_formats_screens_iterator(formats);
+    for (; screens.rem; xcb_render_pictscreen_next(&screens)) {
+        xcb_render_pictdepth_iterator_t depths = xcb_render_pictscreen_depths_iterator(screens.data);
+        for (; depths.rem; xcb_render_pictdepth_next(&depths)) {
+            xcb_render_pictvisual_iterator_t visuals = xcb_render_pictdepth_visuals_iterator(depths.data);
+            for (; visuals.rem; xcb_render_pictvisual_next(&visuals)) {
+                if (visuals.data->visual == visual)
+                    return visuals.data->format;
+            }
+        }
+    }
+    return XCB_NONE;
+}
+
+/*
+ * Finds the standard 8 bit alpha-only format.
+ *
+ */
+static xcb_render_pictformat_t find_a8_format(const xcb_render_query_pict_formats_reply_t *formats) {
+    xcb_render_pictforminfo_iterator_t it = xcb_render_query_pict_formats_formats_iterator(formats);
+    for (; it.rem; xcb_render_pictforminfo_next(&it)) {
+        const xcb_render_pictforminfo_t *info = it.data;
+        if (info->type == XCB_RENDER_PICT_TYPE_DIRECT && info->depth == 8 &&
+            info->direct.alpha_shift == 0 && info->direct.alpha_mask == 0xff &&
+            info->direct.red_mask == 0 && info->direct.green_mask == 0 && info->direct.blue_mask == 0)
+            return info->id;
+    }
+    return XCB_NONE;
+}
+
+/*
+ * Checks whether the Render extension is available and looks up the picture
+ * formats. Returns false if the unlock indicator needs to be drawn with cairo
+ * instead.
+ *
+ */
+bool xrender_init(xcb_connection_t *conn, xcb_screen_t *screen) {
+    const xcb_query_extension_reply_t *extreply;
+
+    extreply = xcb_get_extension_data(conn, &xcb_render_id);
+    if (extreply == NULL || !extreply->present) {
+        DEBUG("Render is not available, drawing the unlock indicator with cairo.\n");
+        return false;
+    }
+
+    xcb_render_query_version_cookie_t version_cookie =
+        xcb_render_query_version(conn, XCB_RENDER_MAJOR_VERSION, XCB_RENDER_MINOR_VERSION);
+    xcb_render_query_pict_formats_cookie_t formats_cookie = xcb_render_query_pict_formats(conn);
+
+    xcb_render_query_version_reply_t *version = xcb_render_query_version_reply(conn, version_cookie, NULL);
+    xcb_render_query_pict_formats_reply_t *formats = xcb_render_query_pict_formats_reply(conn, formats_cookie, NULL);
+    if (version == NULL || formats == NULL) {
+        DEBUG("Could not query Render version and formats\n");
+        free(version);
+        free(formats);
+        return false;
+    }
+    DEBUG("Using Render %d.%d\n", version->major_version, version->minor_version);
+    free(version);
+
+    visual_format = find_visual_format(formats, screen->root_visual);
+    a8_format = find_a8_format(formats);
+    free(formats);
+    if (visual_format == XCB_NONE || a8_format == XCB_NONE) {
+        DEBUG("Render does not support the root visual, drawing the unlock indicator with cairo.\n");
+        return false;
+    }
+
+    xrender_conn = conn;
+    xrender_active = true;
+    return true;
+}
+
+/*
+ * Returns whether the unlock indicator is drawn using Render.
+ *
+ */
+bool xrender_enabled(void) {
+    return xrender_active;
+}
+
+/*
+ * Creates a picture for drawing onto the given (root depth) pixmap.
+ *
+ */
+xcb_render_picture_t xrender_create_picture(xcb_pixmap_t pixmap) {
+    xcb_render_picture_t picture = xcb_generate_id(xrender_conn);
+    xcb_render_create_picture(xrender_conn, picture, pixmap, visual_format, 0, NULL);
+    return picture;
+}
+
+void xrender_free_picture(xcb_render_picture_t picture) {
+    if (picture != XCB_NONE)
+        xcb_render_free_picture(xrender_conn, picture);
+}
+
+/*
+ * Uploads the bullet glyph, replacing the previous one. data is an 8 bit
+ * alpha mask whose rows are padded to 32 bit, like cairo’s A8 images. Its
+ * origin (the pen position) is at (-x, -y) within the mask.
+ *
+ */
+void xrender_set_glyph(const uint8_t *data, int stride, int width, int height, int x, int y, int advance) {
+    if (glyphset != XCB_NONE)
+        xcb_render_free_glyph_set(xrender_conn, glyphset);
+    glyphset = xcb_generate_id(xrender_conn);
+    xcb_render_create_glyph_set(xrender_conn, glyphset, a8_format);
+
+    const uint32_t id = 0;
+    const xcb_render_glyphinfo_t info = {
+        .width = width,
+        .height = height,
+        .x = -x,
+        .y = -y,
+        .x_off = advance,
+        .y_off = 0,
+    };
+    xcb_render_add_glyphs(xrender_conn, glyphset, 1, &id, &info, (uint32_t)stride * height, data);
+    DEBUG("uploaded %d x %d px glyph\n", width, height);
+}
+
+/*
+ * Draws count bullets starting at the given pen position onto the picture, in
+ * the given color (components from 0 to 1).
+ *
+ */
+void xrender_draw_glyphs(xcb_render_picture_t target, int count, int x, int y,
+                         double red, double green, double blue) {
+    const xcb_render_color_t color = {
+        .red = red * 0xffff,
+        .green = green * 0xffff,
+        .blue = blue * 0xffff,
+        .alpha = 0xffff,
+    };
+    if (fill == XCB_NONE || memcmp(&color, &fill_color, sizeof(color)) != 0) {
+        if (fill != XCB_NONE)
+            xcb_render_free_picture(xrender_conn, fill);
+        fill = xcb_generate_id(xrender_conn);
+        xcb_render_create_solid_fill(xrender_conn, fill, color);
+        fill_color = color;
+    }
+
+    /* A single glyph element: its length, 3 bytes of padding, the position
+     * and the glyph ids, padded to 32 bit. */
+    uint8_t cmds[8 + 256];
+    if (count > 252)
+        count = 252;
+    memset(cmds, '\0', sizeof(cmds));
+    cmds[0] = count;
+    const int16_t dx = x, dy = y;
+    memcpy(cmds + 4, &dx, sizeof(dx));
+    memcpy(cmds + 6, &dy, sizeof(dy));
+    const uint32_t length = 8 + ((count + 3) & ~3);
+    xcb_render_composite_glyphs_8(xrender_conn, XCB_RENDER_PICT_OP_OVER, fill, target, a8_format,
+                                  glyphset, 0, 0, length, cmds);
+}
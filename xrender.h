@@ -0,0 +1,17 @@
+#ifndef _XRENDER_H
+#define _XRENDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+#include <xcb/render.h>
+
+bool xrender_init(xcb_connection_t *conn, xcb_screen_t *screen);
+bool xrender_enabled(void);
+xcb_render_picture_t xrender_create_picture(xcb_pixmap_t pixmap);
+void xrender_free_picture(xcb_render_picture_t picture);
+void xrender_set_glyph(const uint8_t *data, int stride, int width, int height, int x, int y, int advance);
+void xrender_draw_glyphs(xcb_render_picture_t target, int count, int x, int y,
+                         double red, double green, double blue);
+
+#endif